@@ -17,6 +17,8 @@ const src_aarch64_vgic_v3 = [_][]const u8{
 const src_aarch64 = [_][]const u8{
     "src/arch/aarch64/vgic/vgic.c",
     "src/arch/aarch64/fault.c",
+    "src/arch/aarch64/decode.c",
+    "src/arch/aarch64/fault_stats.c",
     "src/arch/aarch64/psci.c",
     "src/arch/aarch64/smc.c",
     "src/arch/aarch64/virq.c",
@@ -90,6 +90,7 @@ void init(void) {
     size_t kernel_size = _guest_kernel_image_end - _guest_kernel_image;
     size_t dtb_size = _guest_dtb_image_end - _guest_dtb_image;
     size_t initrd_size = _guest_initrd_image_end - _guest_initrd_image;
+    guest_set_ram(guest_ram_vaddr, GUEST_RAM_SIZE);
     uintptr_t kernel_pc = linux_setup_images(guest_ram_vaddr,
                                       (uintptr_t) _guest_kernel_image,
                                       kernel_size,
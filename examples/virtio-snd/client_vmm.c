@@ -17,6 +17,13 @@
 #include <serial_config.h>
 #include <sddf/sound/queue.h>
 
+/*
+ * As this is just an example, for simplicity we just make the size of the
+ * guest's "RAM" the same for all platforms. This must match the size of the
+ * RAM region in the system description.
+ */
+#define GUEST_RAM_SIZE 0x8000000
+
 #if defined(BOARD_qemu_arm_virt)
 #define GUEST_DTB_VADDR 0x47000000
 #define GUEST_INIT_RAM_DISK_VADDR 0x46000000
@@ -79,6 +86,7 @@ void init(void) {
     size_t kernel_size = _guest_kernel_image_end - _guest_kernel_image;
     size_t dtb_size = _guest_dtb_image_end - _guest_dtb_image;
     size_t initrd_size = _guest_initrd_image_end - _guest_initrd_image;
+    guest_set_ram(guest_ram_vaddr, GUEST_RAM_SIZE);
     kernel_pc = linux_setup_images(guest_ram_vaddr,
                                       (uintptr_t) _guest_kernel_image,
                                       kernel_size,
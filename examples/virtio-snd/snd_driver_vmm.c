@@ -20,10 +20,10 @@
 
 /*
  * As this is just an example, for simplicity we just make the size of the
- * guest's "RAM" the same for all platforms. For just booting Linux with a
- * simple user-space, 0x10000000 bytes (256MB) is plenty.
+ * guest's "RAM" the same for all platforms. This must match the size of the
+ * RAM region in the system description.
  */
-#define GUEST_RAM_SIZE 0x10000000
+#define GUEST_RAM_SIZE 0x8000000
 
 #if defined(BOARD_qemu_arm_virt)
 #define GUEST_DTB_VADDR 0x47000000
@@ -108,6 +108,7 @@ void init(void) {
     size_t dtb_size = _guest_dtb_image_end - _guest_dtb_image;
     size_t initrd_size = _guest_initrd_image_end - _guest_initrd_image;
 
+    guest_set_ram(guest_ram_vaddr, GUEST_RAM_SIZE);
     uintptr_t kernel_pc = linux_setup_images(guest_ram_vaddr,
                                       (uintptr_t) _guest_kernel_image,
                                       kernel_size,
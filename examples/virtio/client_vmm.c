@@ -63,6 +63,12 @@ static struct virtio_console_device virtio_console;
 
 #define BLK_DATA_SIZE 0x200000
 
+/* Uncomment this to let the block server transfer directly to and from guest RAM,
+ * the virtualiser and driver must map guest RAM at BLK_ZERO_COPY_SDDF_OFFSET
+ * past the start of this client's data region, see virtio_blk_zero_copy_init */
+// #define BLK_ZERO_COPY
+#define BLK_ZERO_COPY_SDDF_OFFSET BLK_DATA_SIZE
+
 #define VIRTIO_BLK_IRQ (75)
 #define VIRTIO_BLK_BASE (0x150000)
 #define VIRTIO_BLK_SIZE (0x1000)
@@ -87,6 +93,7 @@ void init(void)
     size_t kernel_size = _guest_kernel_image_end - _guest_kernel_image;
     size_t dtb_size = _guest_dtb_image_end - _guest_dtb_image;
     size_t initrd_size = _guest_initrd_image_end - _guest_initrd_image;
+    guest_set_ram(guest_ram_vaddr, GUEST_RAM_SIZE);
     uintptr_t kernel_pc = linux_setup_images(guest_ram_vaddr,
                                              (uintptr_t) _guest_kernel_image,
                                              kernel_size,
@@ -136,8 +143,12 @@ void init(void)
                         BLK_DATA_SIZE,
                         storage_info,
                         &blk_queue_h,
+                        1,
                         BLK_CH);
     assert(success);
+#if defined(BLK_ZERO_COPY)
+    virtio_blk_zero_copy_init(&virtio_blk, guest_ram_vaddr, GUEST_RAM_SIZE, BLK_ZERO_COPY_SDDF_OFFSET);
+#endif
 
     /* Finally start the guest */
     guest_start(GUEST_VCPU_ID, kernel_pc, GUEST_DTB_VADDR, GUEST_INIT_RAM_DISK_VADDR);
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Decoding of AArch64 load/store instructions, for data aborts where the
+ * hardware does not give us a valid syndrome. This is the case for load/store
+ * pair instructions and for instructions that write back to the base register.
+ */
+
+#define DECODE_MAX_REGS 2
+
+typedef struct decoded_load_store {
+    bool is_load;
+    /* Loaded values are sign extended rather than zero extended */
+    bool sign_extend;
+    /* The transfer registers are X registers rather than W registers */
+    bool is_64bit;
+    /* Size in bytes of each register's access */
+    size_t size;
+    /* Number of transfer registers, accessed at consecutive addresses */
+    size_t num_regs;
+    size_t rt[DECODE_MAX_REGS];
+    /* Base register, 31 is the stack pointer rather than the zero register */
+    size_t rn;
+    /* Offset added to the base, unless it is a register offset */
+    int64_t imm;
+    /* Register offset, Xm or Wm extended then shifted left by rm_shift */
+    bool has_rm;
+    size_t rm;
+    bool rm_is_32bit;
+    bool rm_sign_extend;
+    size_t rm_shift;
+    /* The base is updated with the offset added, post_index means the access
+     * uses the base from before the update */
+    bool writeback;
+    bool post_index;
+} decoded_load_store_t;
+
+/* Returns false if the instruction is not a load or store that can be emulated */
+bool decode_load_store(uint32_t instruction, decoded_load_store_t *ls);
+
+/* Address of the first access, given the values of the base and offset registers */
+uint64_t decode_load_store_address(const decoded_load_store_t *ls, uint64_t xn, uint64_t xm);
+
+/* Value of the base register after writeback */
+uint64_t decode_load_store_writeback(const decoded_load_store_t *ls, uint64_t xn);
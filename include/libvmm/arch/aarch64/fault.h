@@ -23,6 +23,18 @@ bool fault_handle_vm_exception(size_t vcpu_id);
 typedef bool (*vm_exception_handler_t)(size_t vcpu_id, size_t offset, size_t fsr, seL4_UserContext *regs, void *data);
 bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback, void *data);
 
+/*
+ * Registers of the faulting vCPU, cached for the duration of the fault. seL4
+ * transfers TCB registers as a prefix of seL4_UserContext, so only the first
+ * count registers are read, see FAULT_REGS_COUNT. Anything modified through
+ * the returned context besides the PC and the Rt of fault_advance and
+ * fault_emulate_write must be marked with fault_regs_dirty to be written back
+ * by fault_advance_vcpu.
+ */
+#define FAULT_REGS_COUNT(reg) (offsetof(seL4_UserContext, reg) / sizeof(seL4_Word) + 1)
+seL4_UserContext *fault_regs_get(size_t vcpu_id, size_t count);
+void fault_regs_dirty(seL4_UserContext *regs, seL4_Word *reg);
+
 /* Helpers for emulating the fault and getting fault details */
 bool fault_advance_vcpu(size_t vcpu_id, seL4_UserContext *regs);
 bool fault_advance(size_t vcpu_id, seL4_UserContext *regs, uint64_t addr, uint64_t fsr, uint64_t reg_val);
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <microkit.h>
+
+/*
+ * Optional profiling of guest exits, enabled by defining FAULT_STATS when
+ * building libvmm. Every fault is counted and timed by its label, and
+ * virtual memory faults are additionally counted by the region and the
+ * address that was accessed, which makes it easy to find the few device
+ * registers responsible for most exits.
+ *
+ * Time is measured with the generic timer's virtual counter, which needs
+ * seL4 to be configured to export it to user-level (KernelArmExportVCNTUser).
+ * Defining FAULT_STATS_PMU as well uses the PMU cycle counter instead, which
+ * needs KernelArmExportPMUUser.
+ */
+
+#if defined(FAULT_STATS)
+static inline uint64_t fault_stats_now(void)
+{
+    uint64_t now;
+#if defined(FAULT_STATS_PMU)
+    asm volatile("isb; mrs %0, pmccntr_el0" : "=r"(now));
+#else
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(now));
+#endif
+    return now;
+}
+
+/* Record a fault with the given label that took ticks to handle */
+void fault_stats_record_fault(seL4_Word label, uint64_t ticks);
+/* Record an access to addr that was emulated by the handler of the region starting at region */
+void fault_stats_record_mmio(uintptr_t region, uintptr_t addr, bool is_write, uint64_t ticks);
+#else
+/* Compiled out so that callers do not need to check for FAULT_STATS */
+static inline uint64_t fault_stats_now(void)
+{
+    return 0;
+}
+
+static inline void fault_stats_record_fault(seL4_Word label, uint64_t ticks) {}
+static inline void fault_stats_record_mmio(uintptr_t region, uintptr_t addr, bool is_write, uint64_t ticks) {}
+#endif
+
+/*
+ * Print the statistics gathered so far, for example when the VMM is notified
+ * on a debug channel. Does nothing but say so when FAULT_STATS is not defined.
+ */
+void fault_stats_dump(void);
+void fault_stats_reset(void);
@@ -134,6 +134,18 @@ static inline bool is_active(struct gic_dist_map *gic_dist, int irq, int vcpu_id
     }
 }
 
+/* Priority as programmed by the guest through IPRIORITYR, at list register granularity */
+static inline int get_priority(struct gic_dist_map *gic_dist, int irq, int vcpu_id)
+{
+    uint32_t reg;
+    if (irq < NUM_VCPU_LOCAL_VIRQS) {
+        reg = gic_dist->priority0[vcpu_id][irq / 4];
+    } else {
+        reg = gic_dist->priority[(irq - NUM_VCPU_LOCAL_VIRQS) / 4];
+    }
+    return ((reg >> ((irq % 4) * 8)) & 0xff) >> IRQ_PRIORITY_SHIFT;
+}
+
 static void vgic_dist_enable_irq(vgic_t *vgic, size_t vcpu_id, int irq)
 {
     LOG_DIST("Enabling IRQ %d\n", irq);
@@ -204,10 +216,10 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, size_t vcpu_id, int irq)
     LOG_DIST("Pending set: Inject IRQ from pending set (%d)\n", irq);
     set_pending(dist, virq_data->virq, true, vcpu_id);
 
-    /* Enqueueing an IRQ and dequeueing it right after makes little sense
-     * now, but in the future this is needed to support IRQ priorities.
+    /* Go through the queue even if a list register is free, so that the most
+     * urgent of the IRQs waiting is the one that gets it.
      */
-    bool success = vgic_irq_enqueue(vgic, vcpu_id, virq_data);
+    bool success = vgic_irq_enqueue(vgic, vcpu_id, virq_data, get_priority(dist, virq_data->virq, vcpu_id));
     if (!success) {
         LOG_VMM_ERR("Failure enqueueing IRQ, increase MAX_IRQ_QUEUE_LEN");
         assert(0);
@@ -223,7 +235,8 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, size_t vcpu_id, int irq)
         return true;
     }
 
-    struct virq_handle *virq = vgic_irq_dequeue(vgic, vcpu_id);
+    int priority;
+    struct virq_handle *virq = vgic_irq_dequeue(vgic, vcpu_id, &priority);
     assert(virq->virq != VIRQ_INVALID);
 
 #if defined(GIC_V2)
@@ -235,15 +248,61 @@ static bool vgic_dist_set_pending_irq(vgic_t *vgic, size_t vcpu_id, int irq)
 #endif
 
     // @ivanv: I don't understand why GIC v2 is group 0 and GIC v3 is group 1.
-    return vgic_vcpu_load_list_reg(vgic, vcpu_id, idx, group, virq);
+    return vgic_vcpu_load_list_reg(vgic, vcpu_id, idx, group, virq, priority);
 }
 
-static void vgic_dist_clr_pending_irq(struct gic_dist_map *dist, size_t vcpu_id, int irq)
+static void vgic_dist_clr_pending_irq(vgic_t *vgic, size_t vcpu_id, int irq)
 {
     LOG_DIST("Clear pending IRQ %d\n", irq);
+    struct gic_dist_map *dist = vgic_get_dist(vgic->registers);
+    if (!is_pending(dist, irq, vcpu_id)) {
+        return;
+    }
     set_pending(dist, irq, false, vcpu_id);
-    /* TODO: remove from IRQ queue and list registers as well */
-    // @ivanv
+
+    /* The IRQ will not be delivered, so ack it as if it had been for the
+     * source to be able to raise it again. */
+    vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
+    struct virq_handle *queued = vgic_irq_remove(vgic, vcpu_id, irq);
+    if (queued) {
+        vgic_vcpu->retracted.queued++;
+        virq_ack(vcpu_id, queued);
+        return;
+    }
+
+    for (int i = 0; i < vgic->num_list_regs; i++) {
+        if (vgic_vcpu->lr_shadow[i].virq != irq) {
+            continue;
+        }
+
+#if defined(GIC_V2)
+        int group = 0;
+#elif defined(GIC_V3)
+        int group = 1;
+#else
+#error "Unknown GIC version"
+#endif
+
+        /* There is no way to invalidate a list register, but it can be
+         * reused for the next IRQ waiting. Acking the retracted IRQ here is
+         * right even if the guest has EOI'd it already, see
+         * vgic_vcpu_replace_list_reg. */
+        int priority;
+        struct virq_handle *next = vgic_irq_peek(vgic, vcpu_id, &priority);
+        struct virq_handle retracted = vgic_vcpu->lr_shadow[i];
+        if (next && vgic_vcpu_replace_list_reg(vgic, vcpu_id, i, group, next, priority)) {
+            vgic_irq_dequeue(vgic, vcpu_id, &priority);
+            vgic_vcpu->retracted.list_reg++;
+            virq_ack(vcpu_id, &retracted);
+        } else {
+            /* It is delivered anyway, or already being handled, and is acked
+             * through the maintenance interrupt like any other IRQ. With
+             * nothing else waiting this is the common case, see the GIC
+             * section of the manual. */
+            vgic_vcpu->retracted.missed++;
+        }
+        return;
+    }
 }
 
 static bool vgic_dist_reg_read(size_t vcpu_id, vgic_t *vgic, uint64_t offset, uint64_t fsr, seL4_UserContext *regs)
@@ -518,7 +577,7 @@ static bool vgic_dist_reg_write(size_t vcpu_id, vgic_t *vgic, uint64_t offset, u
             irq = CTZ(data);
             data &= ~(1U << irq);
             irq += (offset - GIC_DIST_ICPENDR0) * 8;
-            vgic_dist_clr_pending_irq(gic_dist, vcpu_id, irq);
+            vgic_dist_clr_pending_irq(vgic, vcpu_id, irq);
         }
         break;
     case RANGE32(GIC_DIST_ISACTIVER0, GIC_DIST_ISACTIVER0):
@@ -535,7 +594,13 @@ static bool vgic_dist_reg_write(size_t vcpu_id, vgic_t *vgic, uint64_t offset, u
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ICACTIVER1);
         emulate_reg_write_access(regs, addr, fsr, &gic_dist->active_clr[reg_offset]);
         break;
-    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYRN):
+    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYR7):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR0);
+        emulate_reg_write_access(regs, addr, fsr, &gic_dist->priority0[vcpu_id][reg_offset]);
+        break;
+    case RANGE32(GIC_DIST_IPRIORITYR8, GIC_DIST_IPRIORITYRN):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR8);
+        emulate_reg_write_access(regs, addr, fsr, &gic_dist->priority[reg_offset]);
         break;
     case RANGE32(0x7FC, 0x7FC):
         /* Reserved */
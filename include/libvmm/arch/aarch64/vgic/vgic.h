@@ -59,6 +59,17 @@
 #endif
 
 void vgic_init();
+/*
+ * Keep the distributor's state in shadow rather than in the VMM's own memory.
+ * Shadow is a page that is also mapped read-only into the guest at
+ * GIC_DIST_PADDR, so the guest reads the distributor without faulting while
+ * its writes still fault and are emulated. Must be called after vgic_init.
+ * Only supported for GICv2 with a single vCPU, where the state is laid out
+ * exactly like the real distributor.
+ */
+bool vgic_dist_shadow_init(void *shadow);
+/* Find out how many list registers the GIC has, must be called after vgic_init */
+void vgic_probe_list_regs(size_t vcpu_id);
 bool fault_handle_vgic_maintenance(size_t vcpu_id);
 bool handle_vgic_dist_fault(size_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs);
 bool handle_vgic_redist_fault(size_t vcpu_id, uint64_t fault_addr, uint64_t fsr, seL4_UserContext *regs);
@@ -71,7 +71,7 @@ struct gic_dist_map {
 
     uint32_t sgi_pending_clr[GUEST_NUM_VCPUS][4];   /* [0xF10, 0xF20) */
     uint32_t sgi_pending_set[GUEST_NUM_VCPUS][4];   /* [0xF20, 0xF30) */
-    uint32_t res10[40];                             /* [0xF30, 0xFC0) */
+    uint32_t res10[36];                             /* [0xF30, 0xFC0) */
 
     uint32_t periph_id[12];                         /* [0xFC0, 0xFF0) */
     uint32_t component_id[4];                       /* [0xFF0, 0xFFF] */
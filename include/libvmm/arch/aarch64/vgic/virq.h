@@ -27,6 +27,11 @@
  * been good trade-off that is sufficient for most systems.
  */
 #define NUM_SLOTS_SPI_VIRQ      200
+#define NUM_SPI_VIRQS           988
+/* Marks an SPI without a slot in the lookup table */
+#define SPI_SLOT_NONE           0xff
+
+static_assert(NUM_SLOTS_SPI_VIRQ < SPI_SLOT_NONE, "SPI slot indexes must fit in the lookup table");
 
 #define VIRQ_INVALID -1
 
@@ -44,31 +49,55 @@ static inline void virq_ack(size_t vcpu_id, struct virq_handle *irq)
     irq->ack_fn(vcpu_id, irq->virq, irq->ack_data);
 }
 
-/* TODO: A typical number of list registers supported by GIC is four, but not
- * always. One particular way to probe the number of registers is to inject a
- * dummy IRQ with seL4_ARM_VCPU_InjectIRQ(), using LR index high enough to be
- * not supported by any target; the kernel will reply with the supported range
- * of LR indexes.
+/* A typical number of list registers supported by GIC is four, but not always,
+ * so the actual number is probed at initialisation, see vgic_probe_list_regs.
+ * GICv2 allows for up to 64 list registers, GICv3 for up to 16.
  */
-#define NUM_LIST_REGS 4
+#define MAX_LIST_REGS 64
+/* Used if probing fails */
+#define DEFAULT_NUM_LIST_REGS 4
 /* This is a rather arbitrary number, increase if needed. */
 #define MAX_IRQ_QUEUE_LEN 64
-#define IRQ_QUEUE_NEXT(_i) (((_i) + 1) & (MAX_IRQ_QUEUE_LEN - 1))
+#define IRQ_QUEUE_NONE 0xff
+
+static_assert(MAX_IRQ_QUEUE_LEN < IRQ_QUEUE_NONE, "IRQ queue indexes must fit in a uint8_t");
 
-static_assert((MAX_IRQ_QUEUE_LEN & (MAX_IRQ_QUEUE_LEN - 1)) == 0,
-              "IRQ ring buffer size must be power of two");
+/* List registers only hold the top five bits of the guest's 8-bit priorities,
+ * so that is the granularity pending IRQs are ordered at. Lower is more urgent. */
+#define NUM_IRQ_PRIORITIES 32
+#define IRQ_PRIORITY_SHIFT 3
 
-// @ivanv: make a note of all datastructure invariants
+/*
+ * IRQs waiting for a list register, in a FIFO per priority. Entries come from a
+ * shared pool linked through next, and pending has a bit set for every
+ * priority with a non-empty FIFO so the most urgent one is found with CTZ.
+ */
 struct irq_queue {
-    struct virq_handle *irqs[MAX_IRQ_QUEUE_LEN]; /* circular buffer */
-    uint64_t head;
-    uint64_t tail;
+    struct virq_handle *irqs[MAX_IRQ_QUEUE_LEN];
+    uint8_t next[MAX_IRQ_QUEUE_LEN];
+    uint8_t free;
+    uint8_t head[NUM_IRQ_PRIORITIES];
+    uint8_t tail[NUM_IRQ_PRIORITIES];
+    uint32_t pending;
 };
 
+static_assert(NUM_IRQ_PRIORITIES <= 32, "Pending priorities must fit in the bitmap");
+
 /* vCPU specific interrupt context */
 typedef struct vgic_vcpu {
     /* Mirrors the GIC's vCPU list registers */
-    struct virq_handle lr_shadow[NUM_LIST_REGS];
+    struct virq_handle lr_shadow[MAX_LIST_REGS];
+    /* Priority each list register was loaded with */
+    uint8_t lr_priority[MAX_LIST_REGS];
+    /* IRQs the guest cleared the pending state of before they were delivered */
+    struct {
+        /* Removed from the queue */
+        uint64_t queued;
+        /* Replaced in a list register by an IRQ from the queue */
+        uint64_t list_reg;
+        /* Left in a list register, either active or with nothing to replace it */
+        uint64_t missed;
+    } retracted;
     /* Queue for IRQs that don't fit in the GIC's vCPU list registers */
     struct irq_queue irq_queue;
     /*  vCPU local interrupts (SGI, PPI) */
@@ -81,8 +110,13 @@ typedef struct vgic {
     void *registers;
     /* registered global interrupts (SPI) */
     struct virq_handle vspis[NUM_SLOTS_SPI_VIRQ];
+    /* Slot in vspis of each SPI, indexed by IRQ number minus the local IRQs, or
+     * SPI_SLOT_NONE. Keeps lookups on the injection path O(1) for ~1KiB. */
+    uint8_t spi_slots[NUM_SPI_VIRQS];
     /* vCPU specific interrupt context */
     vgic_vcpu_t vgic_vcpu[GUEST_NUM_VCPUS];
+    /* Number of list registers the hardware has, only that many of lr_shadow are used */
+    int num_list_regs;
 } vgic_t;
 
 static inline vgic_vcpu_t *get_vgic_vcpu(vgic_t *vgic, int vcpu_id)
@@ -100,14 +134,21 @@ static inline struct virq_handle *virq_get_sgi_ppi(vgic_t *vgic, size_t vcpu_id,
     return &vgic_vcpu->local_virqs[virq];
 }
 
+static inline void virq_spi_slots_init(struct vgic *vgic)
+{
+    memset(vgic->spi_slots, SPI_SLOT_NONE, sizeof(vgic->spi_slots));
+}
+
 static inline struct virq_handle *virq_find_spi_irq_data(struct vgic *vgic, int virq)
 {
-    for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
-        if (vgic->vspis[i].virq != VIRQ_INVALID && vgic->vspis[i].virq == virq) {
-            return &vgic->vspis[i];
-        }
+    if (virq < NUM_VCPU_LOCAL_VIRQS || virq >= NUM_VCPU_LOCAL_VIRQS + NUM_SPI_VIRQS) {
+        return NULL;
     }
-    return NULL;
+    uint8_t slot = vgic->spi_slots[virq - NUM_VCPU_LOCAL_VIRQS];
+    if (slot == SPI_SLOT_NONE) {
+        return NULL;
+    }
+    return &vgic->vspis[slot];
 }
 
 static inline struct virq_handle *virq_find_irq_data(struct vgic *vgic, size_t vcpu_id, int virq)
@@ -120,9 +161,20 @@ static inline struct virq_handle *virq_find_irq_data(struct vgic *vgic, size_t v
 
 static inline bool virq_spi_add(vgic_t *vgic, struct virq_handle *virq_data)
 {
+    int spi = virq_data->virq - NUM_VCPU_LOCAL_VIRQS;
+    if (spi < 0 || spi >= NUM_SPI_VIRQS) {
+        LOG_VMM_ERR("Could not add SPI IRQ (0x%lx), invalid IRQ number.\n", virq_data->virq);
+        return false;
+    }
+    if (vgic->spi_slots[spi] != SPI_SLOT_NONE) {
+        LOG_VMM_ERR("SPI IRQ (0x%lx) already registered.\n", virq_data->virq);
+        return false;
+    }
+
     for (int i = 0; i < ARRAY_SIZE(vgic->vspis); i++) {
         if (vgic->vspis[i].virq == VIRQ_INVALID) {
             vgic->vspis[i] = *virq_data;
+            vgic->spi_slots[spi] = i;
             return true;
         }
     }
@@ -155,43 +207,138 @@ static inline bool virq_add(size_t vcpu_id, vgic_t *vgic, struct virq_handle *vi
     return virq_spi_add(vgic, virq_handle);
 }
 
-static inline bool vgic_irq_enqueue(vgic_t *vgic, size_t vcpu_id, struct virq_handle *irq)
+static inline void vgic_irq_queue_init(struct irq_queue *q)
+{
+    for (int i = 0; i < MAX_IRQ_QUEUE_LEN; i++) {
+        q->irqs[i] = NULL;
+        q->next[i] = (i + 1 < MAX_IRQ_QUEUE_LEN) ? i + 1 : IRQ_QUEUE_NONE;
+    }
+    q->free = 0;
+    for (int i = 0; i < NUM_IRQ_PRIORITIES; i++) {
+        q->head[i] = IRQ_QUEUE_NONE;
+        q->tail[i] = IRQ_QUEUE_NONE;
+    }
+    q->pending = 0;
+}
+
+static inline bool vgic_irq_enqueue(vgic_t *vgic, size_t vcpu_id, struct virq_handle *irq, int priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
     struct irq_queue *q = &vgic_vcpu->irq_queue;
+    assert(priority >= 0 && priority < NUM_IRQ_PRIORITIES);
 
     // @ivanv: add "unlikely" call
-    if (IRQ_QUEUE_NEXT(q->tail) == q->head) {
+    if (q->free == IRQ_QUEUE_NONE) {
         return false;
     }
 
-    q->irqs[q->tail] = irq;
-    q->tail = IRQ_QUEUE_NEXT(q->tail);
+    uint8_t entry = q->free;
+    q->free = q->next[entry];
+    q->irqs[entry] = irq;
+    q->next[entry] = IRQ_QUEUE_NONE;
+
+    if (q->tail[priority] == IRQ_QUEUE_NONE) {
+        q->head[priority] = entry;
+    } else {
+        q->next[q->tail[priority]] = entry;
+    }
+    q->tail[priority] = entry;
+    q->pending |= 1U << priority;
 
     return true;
 }
 
-static inline struct virq_handle *vgic_irq_dequeue(vgic_t *vgic, size_t vcpu_id)
+/* Dequeue the longest waiting IRQ of the most urgent priority, returning its priority in priority */
+static inline struct virq_handle *vgic_irq_dequeue(vgic_t *vgic, size_t vcpu_id, int *priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
     struct irq_queue *q = &vgic_vcpu->irq_queue;
-    struct virq_handle *virq = NULL;
 
-    if (q->head != q->tail) {
-        virq = q->irqs[q->head];
-        q->head = IRQ_QUEUE_NEXT(q->head);
+    if (q->pending == 0) {
+        return NULL;
     }
 
+    int p = CTZ(q->pending);
+    uint8_t entry = q->head[p];
+    struct virq_handle *virq = q->irqs[entry];
+
+    q->head[p] = q->next[entry];
+    if (q->head[p] == IRQ_QUEUE_NONE) {
+        q->tail[p] = IRQ_QUEUE_NONE;
+        q->pending &= ~(1U << p);
+    }
+    q->irqs[entry] = NULL;
+    q->next[entry] = q->free;
+    q->free = entry;
+
+    *priority = p;
     return virq;
 }
 
+/* Like vgic_irq_dequeue but leaves the IRQ in the queue */
+static inline struct virq_handle *vgic_irq_peek(vgic_t *vgic, size_t vcpu_id, int *priority)
+{
+    vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
+    assert(vgic_vcpu);
+    struct irq_queue *q = &vgic_vcpu->irq_queue;
+
+    if (q->pending == 0) {
+        return NULL;
+    }
+
+    int p = CTZ(q->pending);
+    *priority = p;
+    return q->irqs[q->head[p]];
+}
+
+/* Take irq out of the queue wherever it is, returns its handle or NULL if it was not queued */
+static inline struct virq_handle *vgic_irq_remove(vgic_t *vgic, size_t vcpu_id, int irq)
+{
+    vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
+    assert(vgic_vcpu);
+    struct irq_queue *q = &vgic_vcpu->irq_queue;
+
+    uint32_t pending = q->pending;
+    while (pending) {
+        int p = CTZ(pending);
+        pending &= ~(1U << p);
+
+        uint8_t prev = IRQ_QUEUE_NONE;
+        for (uint8_t entry = q->head[p]; entry != IRQ_QUEUE_NONE; prev = entry, entry = q->next[entry]) {
+            struct virq_handle *virq = q->irqs[entry];
+            if (virq->virq != irq) {
+                continue;
+            }
+
+            if (prev == IRQ_QUEUE_NONE) {
+                q->head[p] = q->next[entry];
+            } else {
+                q->next[prev] = q->next[entry];
+            }
+            if (q->tail[p] == entry) {
+                q->tail[p] = prev;
+            }
+            if (q->head[p] == IRQ_QUEUE_NONE) {
+                q->pending &= ~(1U << p);
+            }
+            q->irqs[entry] = NULL;
+            q->next[entry] = q->free;
+            q->free = entry;
+
+            return virq;
+        }
+    }
+
+    return NULL;
+}
+
 static inline int vgic_find_empty_list_reg(vgic_t *vgic, size_t vcpu_id)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
-    for (int i = 0; i < ARRAY_SIZE(vgic_vcpu->lr_shadow); i++) {
+    for (int i = 0; i < vgic->num_list_regs; i++) {
         if (vgic_vcpu->lr_shadow[i].virq == VIRQ_INVALID) {
             return i;
         }
@@ -200,14 +347,45 @@ static inline int vgic_find_empty_list_reg(vgic_t *vgic, size_t vcpu_id)
     return -1;
 }
 
-static inline bool vgic_vcpu_load_list_reg(vgic_t *vgic, size_t vcpu_id, int idx, int group, struct virq_handle *virq)
+static inline bool vgic_vcpu_load_list_reg(vgic_t *vgic, size_t vcpu_id, int idx, int group, struct virq_handle *virq,
+                                           int priority)
 {
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
     assert(vgic_vcpu);
-    assert((idx >= 0) && (idx < ARRAY_SIZE(vgic_vcpu->lr_shadow)));
-    // @ivanv: why is the priority 0?
-    microkit_arm_vcpu_inject_irq(vcpu_id, virq->virq, 0, group, idx);
+    assert((idx >= 0) && (idx < vgic->num_list_regs));
+    /* The GIC presents the most urgent pending list register to the guest first */
+    microkit_arm_vcpu_inject_irq(vcpu_id, virq->virq, priority, group, idx);
+    vgic_vcpu->lr_shadow[idx] = *virq;
+    vgic_vcpu->lr_priority[idx] = priority;
+
+    return true;
+}
+
+/*
+ * Overwrite a list register that has not been acknowledged by the guest yet.
+ * Returns false if the list register is active.
+ *
+ * A list register the guest has already EOI'd, but whose maintenance fault has
+ * not reached us yet, looks the same as a pending one, and overwriting it also
+ * stops that maintenance fault from ever arriving. The caller must therefore
+ * ack the IRQ in the list register itself, and this is only correct when that
+ * IRQ is meant to go away whether or not the guest has seen it. That is why a
+ * pending IRQ is never evicted to make room for a more urgent one, as it would
+ * need to be queued again instead, but one the guest retracts can be replaced.
+ */
+static inline bool vgic_vcpu_replace_list_reg(vgic_t *vgic, size_t vcpu_id, int idx, int group,
+                                              struct virq_handle *virq, int priority)
+{
+    vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(vgic, vcpu_id);
+    assert(vgic_vcpu);
+    assert((idx >= 0) && (idx < vgic->num_list_regs));
+    seL4_Error err = seL4_ARM_VCPU_InjectIRQ(BASE_VCPU_CAP + vcpu_id, virq->virq, priority, group, idx);
+    if (err != seL4_NoError) {
+        /* seL4_DeleteFirst, the guest is handling the IRQ in it */
+        return false;
+    }
     vgic_vcpu->lr_shadow[idx] = *virq;
+    vgic_vcpu->lr_priority[idx] = priority;
 
     return true;
 }
@@ -9,3 +9,13 @@
 bool guest_start(size_t boot_vcpu_id, uintptr_t kernel_pc, uintptr_t dtb, uintptr_t initrd);
 void guest_stop(size_t boot_vcpu_id);
 bool guest_restart(size_t boot_vcpu_id, uintptr_t guest_ram_vaddr, size_t guest_ram_size);
+
+/*
+ * Tell libvmm where the guest's RAM is, it is expected to be mapped into the
+ * VMM at the same address as the guest physical address. This is needed to
+ * emulate accesses that the hardware does not fully describe, as the faulting
+ * instruction then has to be read from the guest.
+ */
+void guest_set_ram(uintptr_t guest_ram_vaddr, size_t guest_ram_size);
+/* Returns where [addr, addr + size) in guest physical memory is mapped in the VMM, or NULL if it is not all RAM */
+void *guest_ram_ptr(uintptr_t addr, size_t size);
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Buddy allocator for a region made up of fixed size cells, such as the
+ * BLK_TRANSFER_SIZE buffers of a sDDF data region.
+ *
+ * There is a free list for each power-of-two block size and a bitmask of
+ * which lists are non-empty, so finding a block is a single count trailing
+ * zeros. An allocation of count cells takes the smallest block that fits and
+ * gives the unused tail straight back, so at most count cells are ever in use
+ * for it. Allocation and freeing are bounded by the number of orders rather
+ * than the number of cells.
+ */
+
+#define BUDDY_MAX_ORDER 31
+#define BUDDY_NONE UINT32_MAX
+
+typedef struct buddy {
+    uintptr_t base;
+    uint64_t cell_size;
+    uint32_t num_cells;
+    /* Bit n is set if there is a free block of 2^n cells */
+    uint32_t free_orders;
+    uint32_t free_list[BUDDY_MAX_ORDER + 1];
+    /* Per cell metadata, only meaningful for the first cell of a free block */
+    uint32_t *next;
+    uint32_t *prev;
+    uint8_t *order;
+} buddy_t;
+
+/* next, prev and order must each have room for num_cells entries */
+void buddy_init(buddy_t *buddy,
+                uintptr_t base,
+                uint64_t cell_size,
+                uint32_t num_cells,
+                uint32_t *next,
+                uint32_t *prev,
+                uint8_t *order);
+
+/* Returns true if count contiguous cells cannot currently be allocated */
+bool buddy_full(buddy_t *buddy, uint32_t count);
+
+/* Allocates count contiguous cells, returns false if that is not possible */
+bool buddy_alloc(buddy_t *buddy, uintptr_t *addr, uint32_t count);
+
+/* Frees count cells starting at addr, which must match a previous allocation */
+void buddy_free(buddy_t *buddy, uintptr_t addr, uint32_t count);
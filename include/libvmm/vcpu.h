@@ -7,6 +7,13 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 void vcpu_reset(size_t vcpu_id);
 void vcpu_print_regs(size_t vcpu_id);
+/*
+ * Translate a virtual address of the guest to a guest physical address by
+ * walking the guest's page tables, which must be in guest RAM.
+ */
+bool vcpu_translate_va(size_t vcpu_id, uint64_t va, uint64_t *ipa);
@@ -34,7 +34,7 @@
 
 #include <stdint.h>
 #include <libvmm/virtio/mmio.h>
-#include <sddf/util/fsmalloc.h>
+#include <libvmm/util/buddy.h>
 #include <sddf/util/ialloc.h>
 #include <sddf/blk/queue.h>
 
@@ -90,6 +90,18 @@ struct virtio_blk_config {
     } topology;
     /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
     uint8_t writeback;
+    uint8_t unused0;
+    /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+    uint16_t num_queues;
+    /* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    /* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __attribute__((packed));
 
 /*
@@ -113,6 +125,12 @@ struct virtio_blk_config {
 /* Get device ID command */
 #define VIRTIO_BLK_T_GET_ID         8
 
+/* Discard command */
+#define VIRTIO_BLK_T_DISCARD        11
+
+/* Write zeroes command */
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
 /* Barrier before this op. */
 #define VIRTIO_BLK_T_BARRIER    0x80000000
 
@@ -126,6 +144,18 @@ struct virtio_blk_outhdr {
     uint64_t sector;
 } __attribute__((packed));
 
+/* Data of VIRTIO_BLK_T_DISCARD and VIRTIO_BLK_T_WRITE_ZEROES requests */
+struct virtio_blk_discard_write_zeroes {
+    /* Sector (ie. 512 byte offset) */
+    uint64_t sector;
+    /* Number of 512 byte sectors */
+    uint32_t num_sectors;
+    /* Bit 0 is unmap, the rest are reserved */
+    uint32_t flags;
+} __attribute__((packed));
+
+#define VIRTIO_BLK_DISCARD_F_UNMAP (1 << 0)
+
 /* And this is the final byte of the write scatter-gather list. */
 #define VIRTIO_BLK_S_OK             0
 #define VIRTIO_BLK_S_IOERR          1
@@ -139,7 +169,8 @@ struct virtio_blk_outhdr {
 /* Maximum number of buffers in sddf data region */
 #define SDDF_MAX_DATA_BUFFERS 8192
 
-#define VIRTIO_BLK_NUM_VIRTQ 1
+/* Maximum number of virtqs (VIRTIO_BLK_F_MQ), each one is serviced by its own sDDF queue */
+#define VIRTIO_BLK_MAX_NUM_VIRTQ 4
 #define VIRTIO_BLK_DEFAULT_VIRTQ 0
 
 /* Bookkeeping request data between virtIO and sDDF */
@@ -149,34 +180,128 @@ typedef struct reqbk {
     uint16_t sddf_count;
     uint32_t sddf_block_number;
     uintptr_t virtio_data;
-    uint16_t virtio_data_size;
+    uint32_t virtio_data_size;
     /* Only used for unaligned write from virtIO, if not true, this request is the
     * "read" part of the read-modify-write */
     bool aligned; 
+    /* The sDDF server transfers directly to or from the guest's buffers, nothing
+     * is allocated in the data region */
+    bool zero_copy;
+    /* Next request in the list of deferred read-modify-write writes */
+    uint32_t next;
+    /* Set for requests made by the write cache rather than on behalf of a virtIO
+     * request, in which case virtio_desc_head is not used */
+    uint8_t cache_op;
+    uint16_t cache_entry;
+    /* Device generation the request was made in, see virtio_blk_device */
+    uint32_t generation;
 } reqbk_t;
 
+#define REQBK_NONE UINT32_MAX
+
+/*
+ * Work that could not be handed to sDDF because we ran out of resources
+ * (request ids, data buffers or space in the request queue). It is retried
+ * once responses from the server have freed some up.
+ */
+typedef struct virtio_blk_pending {
+    /* Request taken from the virtq that has not been enqueued yet */
+    bool has_head;
+    uint16_t head;
+    /* Read-modify-write requests whose write has not been enqueued yet */
+    uint32_t rmw_first;
+    uint32_t rmw_last;
+    /* Cache sequence number a parked flush is waiting to be written back, 0 if none */
+    uint64_t flush_seq;
+} virtio_blk_pending_t;
+
+/*
+ * Number of BLK_TRANSFER_SIZE blocks kept in the write-back cache that absorbs
+ * writes smaller than a block. The buffers are taken from the sDDF data region.
+ */
+#ifndef VIRTIO_BLK_CACHE_ENTRIES
+#define VIRTIO_BLK_CACHE_ENTRIES 16
+#endif
+
+/* Number of buckets used to track which blocks have sDDF reads or writes in flight */
+#define VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS 256
+
+typedef struct virtio_blk_cache_entry {
+    bool in_use;
+    /* A load or writeback of this entry is in flight */
+    bool busy;
+    /* The last load or writeback of this entry failed */
+    bool error;
+    /* Mask of the sectors in buf that hold the latest data */
+    uint8_t sectors;
+    uint32_t block;
+    uintptr_t buf;
+    /* Sequence number of the oldest write not covered by a writeback, 0 if clean */
+    uint64_t dirty_seq;
+    /* Sequence number of the oldest write covered by the writeback in flight */
+    uint64_t writeback_seq;
+    /* Sequence number of the latest write, used to pick entries to evict */
+    uint64_t last_seq;
+} virtio_blk_cache_entry_t;
+
+typedef struct virtio_blk_cache {
+    virtio_blk_cache_entry_t entries[VIRTIO_BLK_CACHE_ENTRIES];
+    /* Incremented for every write into the cache */
+    uint64_t seq;
+    /* Count of sDDF reads and writes in flight, hashed by block number. Cache
+     * entries are only loaded, written back or evicted when nothing else is
+     * in flight for their block. */
+    uint16_t inflight[VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS];
+} virtio_blk_cache_t;
+
+/*
+ * Guest memory that the sDDF block server can address directly, see
+ * virtio_blk_zero_copy_init. A size of zero means zero-copy is disabled.
+ */
+typedef struct virtio_blk_zero_copy {
+    uintptr_t guest_base;
+    size_t size;
+    uint64_t sddf_offset;
+} virtio_blk_zero_copy_t;
+
 struct virtio_blk_device {
     struct virtio_device virtio_device;
 
     struct virtio_blk_config config;
-    struct virtio_queue_handler vqs[VIRTIO_BLK_NUM_VIRTQ];
+    struct virtio_queue_handler vqs[VIRTIO_BLK_MAX_NUM_VIRTQ];
 
     reqbk_t reqbk[SDDF_MAX_DATA_BUFFERS];
+    /* Incremented on every device reset. Responses to requests made in an
+     * earlier generation refer to virtqs that no longer exist and are dropped. */
+    uint32_t generation;
+    virtio_blk_pending_t pending[VIRTIO_BLK_MAX_NUM_VIRTQ];
+    virtio_blk_cache_t cache;
     /* Data struct that handles allocation and freeing of fixed size data cells
      * in sDDF memory region */
-    fsmalloc_t fsmalloc;
-    bitarray_t fsmalloc_avail_bitarr;
-    word_t fsmalloc_avail_bitarr_words[roundup_bits2words64(SDDF_MAX_DATA_BUFFERS)];
+    buddy_t data_alloc;
+    uint32_t data_alloc_next[SDDF_MAX_DATA_BUFFERS];
+    uint32_t data_alloc_prev[SDDF_MAX_DATA_BUFFERS];
+    uint8_t data_alloc_order[SDDF_MAX_DATA_BUFFERS];
     /* Index allocator */
     ialloc_t ialloc;
     uint32_t ialloc_idxlist[SDDF_MAX_DATA_BUFFERS];
 
     blk_storage_info_t *storage_info;
-    blk_queue_handle_t queue_h;
+    /* sDDF queue for each virtq, requests from virtq i are serviced by queue_h[i] */
+    blk_queue_handle_t queue_h[VIRTIO_BLK_MAX_NUM_VIRTQ];
     uintptr_t data_region;
+    /* Largest number of BLK_TRANSFER_SIZE buffers a single request can use */
+    uint32_t sddf_data_buffers;
+    virtio_blk_zero_copy_t zero_copy;
     int server_ch;
 };
 
+/*
+ * Initialise a virtIO block device with one virtq for each of the num_queues
+ * sDDF queues given in queue_h. All the sDDF queues share the data region and
+ * the channel to the server. If num_queues is greater than one, VIRTIO_BLK_F_MQ
+ * allows the guest to submit requests on all of them in parallel.
+ */
 bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
                      uintptr_t region_base,
                      uintptr_t region_size,
@@ -185,6 +310,20 @@ bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
                      size_t data_region_size,
                      blk_storage_info_t *storage_info,
                      blk_queue_handle_t *queue_h,
+                     size_t num_queues,
                      int server_ch);
 
 bool virtio_blk_handle_resp(struct virtio_blk_device *blk_dev);
+
+/*
+ * Let the sDDF block server transfer data directly to and from guest memory in
+ * [guest_base, guest_base + size) instead of bouncing it through the data region.
+ * The server must be able to address that memory, with guest_base corresponding
+ * to sddf_offset in the offsets of sDDF requests. Requests whose data is not
+ * contiguous, not inside the window, or not aligned to BLK_TRANSFER_SIZE still
+ * go through the data region. Must be called after virtio_mmio_blk_init.
+ */
+void virtio_blk_zero_copy_init(struct virtio_blk_device *blk_dev,
+                               uintptr_t guest_base,
+                               size_t size,
+                               uint64_t sddf_offset);
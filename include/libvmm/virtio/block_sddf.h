@@ -0,0 +1,22 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/*
+ * sDDF block request codes used by the virtIO block device on top of the ones
+ * sDDF defines in <sddf/blk/queue.h>. They carry no data, only a block number
+ * and count. They are understood by the Linux UIO block driver in
+ * tools/linux/uio_drivers/blk, and the sDDF block virtualiser has to pass them
+ * through like a WRITE_BLOCKS request.
+ *
+ * This header has no dependencies so that drivers outside of the VMM can use it.
+ */
+
+/* The blocks no longer hold useful data, their contents are undefined afterwards */
+#define BLK_REQ_DISCARD 16
+/* The blocks are set to zero */
+#define BLK_REQ_WRITE_ZEROES 17
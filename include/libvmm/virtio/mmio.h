@@ -56,14 +56,51 @@
  */
 #define QUEUE_SIZE 128
 
+/*
+ * State of a virtqueue that is only used when VIRTIO_F_RING_PACKED has been
+ * negotiated. Descriptor chains that the driver makes available are copied into
+ * split-format 'shadow' descriptors so that devices can walk them in the same
+ * way for both ring layouts. The copy is also necessary since the device writes
+ * used descriptors in order of completion, overwriting descriptors of chains that
+ * are still in flight.
+ */
+typedef struct virtio_packed_queue {
+    struct virtq_packed_desc *desc;
+    /* Driver event suppression, written by the driver */
+    struct virtq_packed_event *driver;
+    /* Device event suppression, written by us */
+    struct virtq_packed_event *device;
+    /* Wrap counter of the next descriptor we expect the driver to make available */
+    bool avail_wrap;
+    /* Ring position and wrap counter of the next used descriptor we will write */
+    uint16_t used_idx;
+    bool used_wrap;
+    /* Number of descriptors marked used since we last decided whether to interrupt */
+    uint16_t used_since_signal;
+    struct virtq_desc shadow[QUEUE_SIZE];
+    /* Buffer ID and length in descriptors of each chain, indexed by shadow head */
+    uint16_t shadow_id[QUEUE_SIZE];
+    uint16_t shadow_num[QUEUE_SIZE];
+    /* Head of the list of free shadow descriptors, linked via next */
+    uint16_t shadow_free;
+} virtio_packed_queue_t;
+
 /* handler of a virtqueue */
 // @ivanv: we can pack/bitfield this struct
 typedef struct virtio_queue_handler {
     struct virtq virtq;
     /* is this virtq fully initialised? */
     bool ready;
-    /* the last index that the virtIO device processed */
+    /* true if this virtq uses the packed layout, set when the virtq becomes ready */
+    bool packed;
+    /* the last index that the virtIO device processed, for packed virtqs this
+     * is the ring position of the next descriptor to process */
     uint16_t last_idx;
+    /* used->idx (or used ring position for packed virtqs) at the point we last
+     * decided whether to interrupt the guest, only meaningful if
+     * VIRTIO_RING_F_EVENT_IDX has been negotiated */
+    uint16_t signalled_used;
+    virtio_packed_queue_t packed_state;
 } virtio_queue_handler_t;
 
 struct virtio_device;
@@ -93,6 +130,9 @@ typedef struct virtio_device_info {
     uint32_t DriverFeaturesSel;
     /* True if we are happy with what the driver requires */
     bool features_happy;
+    /* Transport feature bits (e.g VIRTIO_RING_F_EVENT_IDX) accepted by the driver.
+     * These are handled by the MMIO layer and never passed down to the device. */
+    uint64_t transport_features;
 
     uint32_t QueueSel;
     uint32_t QueueNotify;
@@ -129,6 +169,49 @@ typedef struct virtio_device {
  */
 bool virtio_mmio_fault_handle(size_t vcpu_id, size_t offset, size_t fsr, seL4_UserContext *regs, void *data);
 
+/*
+ * Returns true if the guest wants an interrupt for the used buffers that have
+ * been added to the given virtqueue since the last time this was called. If
+ * VIRTIO_RING_F_EVENT_IDX has been negotiated this is decided by the used_event
+ * published by the driver, otherwise by the VIRTQ_AVAIL_F_NO_INTERRUPT flag.
+ * Must be called after used->idx has been updated and before injecting the IRQ.
+ */
+bool virtio_mmio_vq_should_notify(virtio_device_t *dev, virtio_queue_handler_t *vq);
+
+/*
+ * Publishes avail_event so that the driver only kicks us once it makes buffers
+ * available past vq->last_idx. Returns true if more buffers became available
+ * in the meantime, in which case the caller must process them as it will not
+ * be notified of them.
+ */
+bool virtio_mmio_vq_publish_avail_event(virtio_device_t *dev, virtio_queue_handler_t *vq);
+
+/*
+ * Asks the driver to kick us as soon as it makes another buffer available. This
+ * is for devices that had to stop processing the virtq before it was empty.
+ */
+void virtio_mmio_vq_request_kick(virtio_device_t *dev, virtio_queue_handler_t *vq);
+
+/*
+ * Returns true if the driver has made a descriptor chain available that we
+ * have not fetched yet.
+ */
+bool virtio_mmio_vq_has_avail(virtio_queue_handler_t *vq);
+
+/*
+ * Fetches the next descriptor chain the driver has made available. The head
+ * returned indexes vq->virtq.desc regardless of the ring layout negotiated.
+ * Returns false if there is nothing available.
+ */
+bool virtio_mmio_vq_pop(virtio_queue_handler_t *vq, uint16_t *head);
+
+/*
+ * Returns a descriptor chain previously obtained with virtio_mmio_vq_pop to
+ * the driver, with len being the number of bytes written into the chain.
+ * The descriptors of the chain must not be accessed afterwards.
+ */
+void virtio_mmio_vq_push(virtio_queue_handler_t *vq, uint16_t head, uint32_t len);
+
 /*
  * Registers a new virtIO device at a given guest-physical region.
  *
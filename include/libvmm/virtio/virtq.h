@@ -48,10 +48,10 @@
 /* The Guest uses this in avail->flags to advise the Host: don't interrupt me
  * when you consume a buffer.  It's unreliable, so it's simply an
  * optimization.  */
-#define virtq_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
 
 /* We support indirect buffer descriptors */
-#define VIRTQ_AVAIL_F_NO_INTERRUPT  28
+#define VIRTIO_RING_F_INDIRECT_DESC 28
 
 /* The Guest publishes the used index for which it expects an interrupt
  * at the end of the avail ring. Host should ignore the avail->flags field. */
@@ -98,6 +98,38 @@ struct virtq {
     struct virtq_used *used;
 };
 
+/* Packed virtqueue layout, see section 2.8 of the virtIO specification. */
+/* Descriptor flag bits (as bit numbers) used to mark a descriptor available/used */
+#define VIRTQ_PACKED_DESC_F_AVAIL   7
+#define VIRTQ_PACKED_DESC_F_USED    15
+
+/* Values for the flags field of the event suppression structures */
+#define VIRTQ_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VIRTQ_PACKED_EVENT_FLAG_DISABLE 0x1
+/* Only valid if VIRTIO_RING_F_EVENT_IDX has been negotiated */
+#define VIRTQ_PACKED_EVENT_FLAG_DESC    0x2
+
+/* Wrap counter bit in the off_wrap field of the event suppression structures */
+#define VIRTQ_PACKED_EVENT_F_WRAP_CTR   15
+
+struct virtq_packed_desc {
+    /* Buffer address (guest-physical). */
+    uint64_t addr;
+    /* Buffer length. */
+    uint32_t len;
+    /* Buffer ID. */
+    uint16_t id;
+    /* The flags depending on descriptor type. */
+    uint16_t flags;
+};
+
+struct virtq_packed_event {
+    /* Descriptor ring change event offset/wrap counter. */
+    uint16_t off_wrap;
+    /* Descriptor ring change event flags. */
+    uint16_t flags;
+};
+
 /* The standard layout for the ring is a continuous chunk of memory which looks
  * like this.  We assume num is a power of 2.
  *
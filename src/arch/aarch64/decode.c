@@ -0,0 +1,267 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/arch/aarch64/decode.h>
+
+/*
+ * Encodings are from the "Loads and Stores" section of the A64 instruction
+ * set encoding in the Arm Architecture Reference Manual for A-profile.
+ */
+/* Every load/store encoding, bit 26 then selects SIMD&FP registers */
+#define LDST_GROUP_MASK         0x0a000000
+#define LDST_GROUP_VAL          0x08000000
+
+#define LDST_RT(i)              ((i) & 0x1f)
+#define LDST_RN(i)              (((i) >> 5) & 0x1f)
+#define LDST_RT2(i)             (((i) >> 10) & 0x1f)
+#define LDST_RM(i)              (((i) >> 16) & 0x1f)
+#define LDST_SIZE(i)            (((i) >> 30) & 0x3)
+#define LDST_OPC(i)             (((i) >> 22) & 0x3)
+#define LDST_SIMD               (1 << 26)
+
+/* Load/store register (unsigned immediate) */
+#define LDST_UIMM_MASK          0x3b000000
+#define LDST_UIMM_VAL           0x39000000
+#define LDST_UIMM12(i)          (((i) >> 10) & 0xfff)
+
+/* Load/store register (unscaled immediate, immediate pre/post-indexed, unprivileged) */
+#define LDST_IMM9_MASK          0x3b200000
+#define LDST_IMM9_VAL           0x38000000
+#define LDST_IMM9(i)            (((i) >> 12) & 0x1ff)
+#define LDST_IMM9_MODE(i)       (((i) >> 10) & 0x3)
+#define LDST_IMM9_UNSCALED      0
+#define LDST_IMM9_POST_INDEX    1
+#define LDST_IMM9_UNPRIVILEGED  2
+#define LDST_IMM9_PRE_INDEX     3
+
+/* Load/store register (register offset) */
+#define LDST_REG_MASK           0x3b200c00
+#define LDST_REG_VAL            0x38200800
+#define LDST_REG_OPTION(i)      (((i) >> 13) & 0x7)
+#define LDST_REG_S              (1 << 12)
+#define LDST_REG_UXTW           2
+#define LDST_REG_LSL            3
+#define LDST_REG_SXTW           6
+#define LDST_REG_SXTX           7
+
+/* Load/store register pair */
+#define LDST_PAIR_MASK          0x3a000000
+#define LDST_PAIR_VAL           0x28000000
+#define LDST_PAIR_OPC(i)        (((i) >> 30) & 0x3)
+#define LDST_PAIR_MODE(i)       (((i) >> 23) & 0x3)
+#define LDST_PAIR_L             (1 << 22)
+#define LDST_PAIR_IMM7(i)       (((i) >> 15) & 0x7f)
+#define LDST_PAIR_NO_ALLOCATE   0
+#define LDST_PAIR_POST_INDEX    1
+#define LDST_PAIR_OFFSET        2
+#define LDST_PAIR_PRE_INDEX     3
+
+#define SP_REG 31
+
+static int64_t sign_extend(uint64_t value, size_t bits)
+{
+    uint64_t sign = 1UL << (bits - 1);
+    return (int64_t)((value ^ sign) - sign);
+}
+
+/* Work out the size and signedness of a single register load/store from its size and opc fields */
+static bool decode_size_opc(uint32_t instruction, decoded_load_store_t *ls)
+{
+    size_t size = LDST_SIZE(instruction);
+    ls->size = 1UL << size;
+    ls->num_regs = 1;
+    ls->rt[0] = LDST_RT(instruction);
+    ls->rn = LDST_RN(instruction);
+
+    switch (LDST_OPC(instruction)) {
+        case 0:
+            ls->is_load = false;
+            ls->is_64bit = (size == 3);
+            return true;
+        case 1:
+            ls->is_load = true;
+            ls->is_64bit = (size == 3);
+            return true;
+        case 2:
+            /* Sign extending to an X register, with a size of 3 this is a prefetch */
+            if (size == 3) {
+                break;
+            }
+            ls->is_load = true;
+            ls->sign_extend = true;
+            ls->is_64bit = true;
+            return true;
+        case 3:
+            /* Sign extending to a W register */
+            if (size >= 2) {
+                break;
+            }
+            ls->is_load = true;
+            ls->sign_extend = true;
+            ls->is_64bit = false;
+            return true;
+    }
+
+    LOG_VMM_ERR("cannot emulate prefetch or unallocated load/store instruction 0x%x\n", instruction);
+    return false;
+}
+
+static bool decode_pair(uint32_t instruction, decoded_load_store_t *ls)
+{
+    ls->is_load = !!(instruction & LDST_PAIR_L);
+    switch (LDST_PAIR_OPC(instruction)) {
+        case 0:
+            ls->size = 4;
+            break;
+        case 1:
+            /* LDPSW, the store encoding is STGP which has tagging side effects */
+            if (!ls->is_load) {
+                LOG_VMM_ERR("cannot emulate STGP instruction 0x%x\n", instruction);
+                return false;
+            }
+            ls->size = 4;
+            ls->sign_extend = true;
+            ls->is_64bit = true;
+            break;
+        case 2:
+            ls->size = 8;
+            ls->is_64bit = true;
+            break;
+        default:
+            LOG_VMM_ERR("cannot emulate unallocated load/store pair instruction 0x%x\n", instruction);
+            return false;
+    }
+
+    ls->num_regs = 2;
+    ls->rt[0] = LDST_RT(instruction);
+    ls->rt[1] = LDST_RT2(instruction);
+    ls->rn = LDST_RN(instruction);
+    ls->imm = sign_extend(LDST_PAIR_IMM7(instruction), 7) * (int64_t)ls->size;
+
+    switch (LDST_PAIR_MODE(instruction)) {
+        case LDST_PAIR_POST_INDEX:
+            ls->writeback = true;
+            ls->post_index = true;
+            break;
+        case LDST_PAIR_PRE_INDEX:
+            ls->writeback = true;
+            break;
+        default:
+            /* Signed offset or non-temporal, neither write back */
+            break;
+    }
+
+    return true;
+}
+
+bool decode_load_store(uint32_t instruction, decoded_load_store_t *ls)
+{
+    *ls = (decoded_load_store_t) { 0 };
+
+    bool decoded;
+    /*
+     * SIMD&FP registers are not part of the TCB context and seL4 gives us no
+     * way to access the guest's copy of them, so these cannot be emulated.
+     */
+    if ((instruction & LDST_GROUP_MASK) == LDST_GROUP_VAL && (instruction & LDST_SIMD)) {
+        LOG_VMM_ERR("cannot emulate SIMD&FP load/store instruction 0x%x\n", instruction);
+        return false;
+    }
+
+    if ((instruction & LDST_UIMM_MASK) == LDST_UIMM_VAL) {
+        decoded = decode_size_opc(instruction, ls);
+        ls->imm = (int64_t)LDST_UIMM12(instruction) * (int64_t)ls->size;
+    } else if ((instruction & LDST_IMM9_MASK) == LDST_IMM9_VAL) {
+        decoded = decode_size_opc(instruction, ls);
+        ls->imm = sign_extend(LDST_IMM9(instruction), 9);
+        switch (LDST_IMM9_MODE(instruction)) {
+            case LDST_IMM9_POST_INDEX:
+                ls->writeback = true;
+                ls->post_index = true;
+                break;
+            case LDST_IMM9_PRE_INDEX:
+                ls->writeback = true;
+                break;
+            default:
+                /* Unscaled and unprivileged accesses do not write back */
+                break;
+        }
+    } else if ((instruction & LDST_REG_MASK) == LDST_REG_VAL) {
+        decoded = decode_size_opc(instruction, ls);
+        ls->has_rm = true;
+        ls->rm = LDST_RM(instruction);
+        switch (LDST_REG_OPTION(instruction)) {
+            case LDST_REG_UXTW:
+                ls->rm_is_32bit = true;
+                break;
+            case LDST_REG_LSL:
+                break;
+            case LDST_REG_SXTW:
+                ls->rm_is_32bit = true;
+                ls->rm_sign_extend = true;
+                break;
+            case LDST_REG_SXTX:
+                ls->rm_sign_extend = true;
+                break;
+            default:
+                LOG_VMM_ERR("cannot emulate load/store instruction 0x%x with unallocated extend\n", instruction);
+                return false;
+        }
+        if (instruction & LDST_REG_S) {
+            ls->rm_shift = LDST_SIZE(instruction);
+        }
+    } else if ((instruction & LDST_PAIR_MASK) == LDST_PAIR_VAL) {
+        decoded = decode_pair(instruction, ls);
+    } else {
+        LOG_VMM_ERR("cannot emulate instruction 0x%x, it is not a supported load/store\n", instruction);
+        return false;
+    }
+
+    if (!decoded) {
+        return false;
+    }
+
+    /* Architecturally these are unpredictable, refuse rather than guess */
+    if (ls->writeback && ls->rn != SP_REG) {
+        for (size_t i = 0; i < ls->num_regs; i++) {
+            if (ls->rt[i] == ls->rn) {
+                LOG_VMM_ERR("cannot emulate load/store instruction 0x%x that writes back to a transfer register\n",
+                            instruction);
+                return false;
+            }
+        }
+    }
+    if (ls->is_load && ls->num_regs == 2 && ls->rt[0] == ls->rt[1]) {
+        LOG_VMM_ERR("cannot emulate load pair instruction 0x%x with the same transfer registers\n", instruction);
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t decode_load_store_address(const decoded_load_store_t *ls, uint64_t xn, uint64_t xm)
+{
+    if (ls->has_rm) {
+        uint64_t offset = xm;
+        if (ls->rm_is_32bit) {
+            offset = ls->rm_sign_extend ? (uint64_t)sign_extend(offset & 0xffffffff, 32) : (offset & 0xffffffff);
+        }
+        return xn + (offset << ls->rm_shift);
+    }
+
+    if (ls->post_index) {
+        return xn;
+    }
+
+    return xn + ls->imm;
+}
+
+uint64_t decode_load_store_writeback(const decoded_load_store_t *ls, uint64_t xn)
+{
+    assert(ls->writeback);
+    return xn + ls->imm;
+}
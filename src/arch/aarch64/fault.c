@@ -8,9 +8,12 @@
 #include <libvmm/util/util.h>
 #include <libvmm/tcb.h>
 #include <libvmm/vcpu.h>
+#include <libvmm/guest.h>
 #include <libvmm/arch/aarch64/hsr.h>
 #include <libvmm/arch/aarch64/smc.h>
 #include <libvmm/arch/aarch64/fault.h>
+#include <libvmm/arch/aarch64/fault_stats.h>
+#include <libvmm/arch/aarch64/decode.h>
 #include <libvmm/arch/aarch64/vgic/vgic.h>
 
 // #define CPSR_THUMB                 (1 << 5)
@@ -22,12 +25,102 @@
 //     return !CPSR_IS_THUMB(regs->spsr);
 // }
 
+/*
+ * Registers of the vCPU that is currently being handled. seL4 reads and writes
+ * TCB registers as a prefix of seL4_UserContext (pc, sp, spsr, x0, ..., x30,
+ * ...), so rather than transferring the entire context on every exit we only
+ * read up to the furthest register a handler asks for and only write back up
+ * to the furthest register that was modified.
+ */
+static struct {
+    size_t vcpu_id;
+    seL4_UserContext regs;
+    /* Number of registers at the start of regs that hold the vCPU's values */
+    size_t valid;
+    /* Number of registers at the start of regs that must be written back */
+    size_t dirty;
+} fault_regs;
+
+static void fault_regs_reset(size_t vcpu_id)
+{
+    fault_regs.vcpu_id = vcpu_id;
+    fault_regs.valid = 0;
+    fault_regs.dirty = 0;
+}
+
+seL4_UserContext *fault_regs_get(size_t vcpu_id, size_t count)
+{
+    assert(count > 0 && count <= SEL4_USER_CONTEXT_SIZE);
+    if (vcpu_id != fault_regs.vcpu_id) {
+        assert(fault_regs.dirty == 0);
+        fault_regs_reset(vcpu_id);
+    }
+
+    if (count > fault_regs.valid) {
+        /* We can only read from the start of the context, so read into a
+         * temporary to avoid clobbering anything that has been modified. */
+        seL4_UserContext regs;
+        int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + vcpu_id, false, 0, count, &regs);
+        assert(err == seL4_NoError);
+        if (err != seL4_NoError) {
+            LOG_VMM_ERR("Failure reading TCB registers of vCPU 0x%lx, error %d\n", vcpu_id, err);
+            return NULL;
+        }
+        seL4_Word *src = (seL4_Word *)&regs;
+        seL4_Word *dst = (seL4_Word *)&fault_regs.regs;
+        for (size_t i = fault_regs.valid; i < count; i++) {
+            dst[i] = src[i];
+        }
+        fault_regs.valid = count;
+    }
+
+    return &fault_regs.regs;
+}
+
+void fault_regs_dirty(seL4_UserContext *regs, seL4_Word *reg)
+{
+    if (regs != &fault_regs.regs) {
+        /* Not the cached context, everything gets written back anyway */
+        return;
+    }
+    /* Registers outside of the context (e.g the zero register) are never written back */
+    seL4_Word *start = (seL4_Word *)regs;
+    if (reg < start || reg >= start + SEL4_USER_CONTEXT_SIZE) {
+        return;
+    }
+    size_t count = reg - start + 1;
+    assert(count <= fault_regs.valid);
+    if (count > fault_regs.dirty) {
+        fault_regs.dirty = count;
+    }
+}
+
+/*
+ * Set while emulating a decoded instruction one access at a time, the vCPU is
+ * only advanced once all of its accesses have been emulated.
+ */
+static bool fault_decoding;
+
 bool fault_advance_vcpu(size_t vcpu_id, seL4_UserContext *regs) {
+    if (fault_decoding) {
+        return true;
+    }
     // For now we just ignore it and continue
     // Assume 32-bit instruction
     regs->pc += 4;
-    int err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + vcpu_id, true, 0, SEL4_USER_CONTEXT_SIZE, regs);
+    size_t count = SEL4_USER_CONTEXT_SIZE;
+    if (regs == &fault_regs.regs) {
+        assert(vcpu_id == fault_regs.vcpu_id);
+        /* The PC is always first, so only write back what has been modified */
+        fault_regs_dirty(regs, &regs->pc);
+        count = fault_regs.dirty;
+    }
+    int err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + vcpu_id, true, 0, count, regs);
     assert(err == seL4_NoError);
+    if (regs == &fault_regs.regs) {
+        /* The vCPU is resumed, so what we have is no longer up to date */
+        fault_regs_reset(vcpu_id);
+    }
 
     return (err == seL4_NoError);
 }
@@ -162,10 +255,9 @@ static int get_rt(uint64_t fsr)
     if (HSR_IS_SYNDROME_VALID(fsr)) {
         rt = HSR_SYNDROME_RT(fsr);
     } else {
-        printf("decode_insturction for AArch64 not implemented\n");
-        assert(0);
-        // @ivanv: implement decode instruction for aarch64
-        // rt = decode_instruction(f);
+        /* Accesses without a syndrome are decoded by fault_handle_vm_exception
+         * and handed to handlers with one that is valid. */
+        LOG_VMM_ERR("cannot get Rt from FSR 0x%lx without a valid syndrome\n", fsr);
     }
     assert(rt >= 0);
     return rt;
@@ -201,6 +293,7 @@ void fault_emulate_write(seL4_UserContext *regs, size_t addr, size_t fsr, size_t
     int rt = get_rt(fsr);
     seL4_Word *reg_ctx = decode_rt(rt, regs);
     *reg_ctx = fault_emulate(regs, *reg_ctx, addr, fsr, reg_val);
+    fault_regs_dirty(regs, reg_ctx);
 }
 
 bool fault_advance(size_t vcpu_id, seL4_UserContext *regs, uint64_t addr, uint64_t fsr, uint64_t reg_val)
@@ -210,6 +303,7 @@ bool fault_advance(size_t vcpu_id, seL4_UserContext *regs, uint64_t addr, uint64
 
     seL4_Word *reg_ctx = decode_rt(rt, regs);
     *reg_ctx = fault_emulate(regs, *reg_ctx, addr, fsr, reg_val);
+    fault_regs_dirty(regs, reg_ctx);
 
     return fault_advance_vcpu(vcpu_id, regs);
 }
@@ -283,15 +377,14 @@ bool fault_handle_unknown_syscall(size_t vcpu_id)
             return false;
     }
 
-    seL4_UserContext regs;
-    seL4_Error err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + vcpu_id, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(err == seL4_NoError);
-    if (err != seL4_NoError) {
-        LOG_VMM_ERR("Failure reading TCB registers when handling unknown syscall, error %d", err);
+    /* Only the PC is needed to step over the syscall */
+    seL4_UserContext *regs = fault_regs_get(vcpu_id, FAULT_REGS_COUNT(pc));
+    if (regs == NULL) {
+        LOG_VMM_ERR("Failure reading TCB registers when handling unknown syscall\n");
         return false;
     }
 
-    return fault_advance_vcpu(vcpu_id, &regs);
+    return fault_advance_vcpu(vcpu_id, regs);
 }
 
 struct vm_exception_handler {
@@ -300,76 +393,135 @@ struct vm_exception_handler {
     vm_exception_handler_t callback;
     void *data;
 };
-#define MAX_VM_EXCEPTION_HANDLERS 16
+
+/* Maximum number of regions with a registered handler, define before building to change */
+#ifndef MAX_VM_EXCEPTION_HANDLERS
+#define MAX_VM_EXCEPTION_HANDLERS 64
+#endif
+
+/* Sorted by base address, regions never overlap */
 struct vm_exception_handler registered_vm_exception_handlers[MAX_VM_EXCEPTION_HANDLERS];
-size_t vm_exception_handler_index = 0;
+size_t num_vm_exception_handlers = 0;
+/* Guests tend to access the same device many times in a row, so the handler
+ * that matched last is checked before searching. */
+static struct vm_exception_handler *last_vm_exception_handler;
+
+/* Index of the first handler whose region starts after addr */
+static size_t vm_exception_handler_upper_bound(uintptr_t addr)
+{
+    size_t low = 0;
+    size_t high = num_vm_exception_handlers;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (registered_vm_exception_handlers[mid].base <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
 
 bool fault_register_vm_exception_handler(uintptr_t base, size_t size, vm_exception_handler_t callback, void *data) {
-    // @ivanv audit necessary here since this code was written very quickly. Other things to check such
-    // as the region of memory is not overlapping with other regions, also should have GIC_DIST regions
-    // use this API.
-    if (vm_exception_handler_index == MAX_VM_EXCEPTION_HANDLERS - 1) {
+    // @ivanv: should have GIC_DIST regions use this API.
+    if (num_vm_exception_handlers == MAX_VM_EXCEPTION_HANDLERS) {
+        LOG_VMM_ERR("cannot register handler for region [0x%lx..0x%lx), maximum of %d regions reached\n",
+                    base, base + size, MAX_VM_EXCEPTION_HANDLERS);
         return false;
     }
 
     // @ivanv: use a define for page size? preMAture GENeraliZAATION
-    if (base % 0x1000 != 0) {
+    if (base % 0x1000 != 0 || size == 0 || base + size < base) {
         return false;
     }
 
-    registered_vm_exception_handlers[vm_exception_handler_index] = (struct vm_exception_handler) {
+    size_t idx = vm_exception_handler_upper_bound(base);
+    if ((idx > 0 && registered_vm_exception_handlers[idx - 1].end > base) ||
+        (idx < num_vm_exception_handlers && registered_vm_exception_handlers[idx].base < base + size)) {
+        LOG_VMM_ERR("cannot register handler for region [0x%lx..0x%lx), overlaps with an existing region\n",
+                    base, base + size);
+        return false;
+    }
+
+    for (size_t i = num_vm_exception_handlers; i > idx; i--) {
+        registered_vm_exception_handlers[i] = registered_vm_exception_handlers[i - 1];
+    }
+    registered_vm_exception_handlers[idx] = (struct vm_exception_handler) {
         .base = base,
         .end = base + size,
         .callback = callback,
         .data = data,
     };
-    vm_exception_handler_index += 1;
+    num_vm_exception_handlers += 1;
+    /* Entries may have moved */
+    last_vm_exception_handler = NULL;
 
     return true;
 }
 
-static bool fault_handle_registered_vm_exceptions(size_t vcpu_id, uintptr_t addr, size_t fsr, seL4_UserContext *regs) {
-    for (int i = 0; i < MAX_VM_EXCEPTION_HANDLERS; i++) {
-        uintptr_t base = registered_vm_exception_handlers[i].base;
-        uintptr_t end = registered_vm_exception_handlers[i].end;
-        vm_exception_handler_t callback = registered_vm_exception_handlers[i].callback;
-        void *data = registered_vm_exception_handlers[i].data;
-        if (addr >= base && addr < end) {
-            bool success = callback(vcpu_id, addr - base, fsr, regs, data);
-            if (!success) {
-                // @ivanv: improve error message
-                LOG_VMM_ERR("registered virtual memory exception handler for region [0x%lx..0x%lx) at address 0x%lx failed\n", base, end, addr);
-            }
-            /* Whether or not the callback actually successfully handled the
-             * exception, we return true to say that we at least found a handler
-             * for the faulting address. */
-            return true;
-        }
+static struct vm_exception_handler *fault_find_vm_exception_handler(uintptr_t addr)
+{
+    struct vm_exception_handler *handler = last_vm_exception_handler;
+    if (handler && addr >= handler->base && addr < handler->end) {
+        return handler;
     }
 
-    /* We could not find a handler for the faulting address. */
-    return false;
+    size_t idx = vm_exception_handler_upper_bound(addr);
+    if (idx == 0) {
+        return NULL;
+    }
+    handler = &registered_vm_exception_handlers[idx - 1];
+    if (addr >= handler->end) {
+        return NULL;
+    }
+
+    last_vm_exception_handler = handler;
+    return handler;
 }
 
-bool fault_handle_vm_exception(size_t vcpu_id)
-{
-    uintptr_t addr = microkit_mr_get(seL4_VMFault_Addr);
-    size_t fsr = microkit_mr_get(seL4_VMFault_FSR);
+static bool fault_handle_registered_vm_exceptions(size_t vcpu_id, uintptr_t addr, size_t fsr, seL4_UserContext *regs) {
+    struct vm_exception_handler *handler = fault_find_vm_exception_handler(addr);
+    if (!handler) {
+        /* We could not find a handler for the faulting address. */
+        return false;
+    }
 
-    seL4_UserContext regs;
-    int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + vcpu_id, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(err == seL4_NoError);
+    uint64_t start = fault_stats_now();
+    bool success = handler->callback(vcpu_id, addr - handler->base, fsr, regs, handler->data);
+    fault_stats_record_mmio(handler->base, addr, fault_is_write(fsr), fault_stats_now() - start);
+    if (!success) {
+        // @ivanv: improve error message
+        LOG_VMM_ERR("registered virtual memory exception handler for region [0x%lx..0x%lx) at address 0x%lx failed\n", handler->base, handler->end, addr);
+    }
+    /* Whether or not the callback actually successfully handled the
+     * exception, we return true to say that we at least found a handler
+     * for the faulting address. */
+    return true;
+}
 
+/*
+ * Emulate an access to addr that is described by fsr, which must have a valid
+ * syndrome. Returns false if the access could not be emulated.
+ */
+static bool fault_handle_mmio(size_t vcpu_id, uintptr_t addr, size_t fsr, seL4_UserContext *regs)
+{
+    uint64_t start = fault_stats_now();
     switch (addr) {
-        case GIC_DIST_PADDR...GIC_DIST_PADDR + GIC_DIST_SIZE:
-            return handle_vgic_dist_fault(vcpu_id, addr, fsr, &regs);
+        case GIC_DIST_PADDR...GIC_DIST_PADDR + GIC_DIST_SIZE: {
+            bool success = handle_vgic_dist_fault(vcpu_id, addr, fsr, regs);
+            fault_stats_record_mmio(GIC_DIST_PADDR, addr, fault_is_write(fsr), fault_stats_now() - start);
+            return success;
+        }
 #if defined(GIC_V3)
         /* Need to handle redistributor faults for GICv3 platforms. */
-        case GIC_REDIST_PADDR...GIC_REDIST_PADDR + GIC_REDIST_SIZE:
-            return handle_vgic_redist_fault(vcpu_id, addr, fsr, &regs);
+        case GIC_REDIST_PADDR...GIC_REDIST_PADDR + GIC_REDIST_SIZE: {
+            bool success = handle_vgic_redist_fault(vcpu_id, addr, fsr, regs);
+            fault_stats_record_mmio(GIC_REDIST_PADDR, addr, fault_is_write(fsr), fault_stats_now() - start);
+            return success;
+        }
 #endif
         default: {
-            bool success = fault_handle_registered_vm_exceptions(vcpu_id, addr, fsr, &regs);
+            bool success = fault_handle_registered_vm_exceptions(vcpu_id, addr, fsr, regs);
             if (!success) {
                 /*
                  * We could not find a registered handler for the address, meaning that the fault
@@ -386,7 +538,7 @@ bool fault_handle_vm_exception(size_t vcpu_id)
                 vcpu_print_regs(vcpu_id);
             } else {
                 /* @ivanv, is it correct to unconditionally advance the CPU here? */
-                fault_advance_vcpu(vcpu_id, &regs);
+                fault_advance_vcpu(vcpu_id, regs);
             }
 
             return success;
@@ -394,9 +546,176 @@ bool fault_handle_vm_exception(size_t vcpu_id)
     }
 }
 
+/* Mode field of SPSR, for telling which stack pointer the guest is using */
+#define SPSR_MODE_MASK 0xf
+#define SPSR_MODE_EL1H 0x5
+
+static uint64_t fault_get_xn_or_sp(size_t vcpu_id, seL4_UserContext *regs, size_t reg_idx)
+{
+    if (reg_idx != 31) {
+        return *decode_rt(reg_idx, regs);
+    }
+    if ((regs->spsr & SPSR_MODE_MASK) == SPSR_MODE_EL1H) {
+        return microkit_arm_vcpu_read_reg(vcpu_id, seL4_VCPUReg_SP_EL1);
+    }
+    return regs->sp;
+}
+
+static void fault_set_xn_or_sp(size_t vcpu_id, seL4_UserContext *regs, size_t reg_idx, uint64_t val)
+{
+    seL4_Word *reg;
+    if (reg_idx != 31) {
+        reg = decode_rt(reg_idx, regs);
+    } else if ((regs->spsr & SPSR_MODE_MASK) == SPSR_MODE_EL1H) {
+        microkit_arm_vcpu_write_reg(vcpu_id, seL4_VCPUReg_SP_EL1, val);
+        return;
+    } else {
+        reg = &regs->sp;
+    }
+    *reg = val;
+    fault_regs_dirty(regs, reg);
+}
+
+/*
+ * Emulate a single register's access of a decoded instruction. Accesses that
+ * land in guest RAM (e.g the first half of a pair straddling the end of RAM)
+ * are done directly, anything else is given to the emulated device with a
+ * syndrome made up to look like the hardware gave one.
+ */
+static bool fault_emulate_decoded_access(size_t vcpu_id, const decoded_load_store_t *ls, size_t rt,
+                                         uint64_t va, seL4_UserContext *regs)
+{
+    uint64_t ipa;
+    if (!vcpu_translate_va(vcpu_id, va, &ipa)) {
+        return false;
+    }
+
+    seL4_Word *reg = decode_rt(rt, regs);
+    void *ram = guest_ram_ptr(ipa, ls->size);
+    if (ram != NULL) {
+        if (ls->is_load) {
+            *reg = 0;
+            memcpy(reg, ram, ls->size);
+        } else {
+            memcpy(ram, reg, ls->size);
+        }
+    } else {
+        size_t fsr = HSR_SYNDROME_VALID | ((size_t)(__builtin_ctzl(ls->size)) << 22) | (rt << 16);
+        if (!ls->is_load) {
+            fsr |= (1U << 6);
+        } else {
+            /* Handlers only replace the bytes they read */
+            *reg = 0;
+        }
+        if (!fault_handle_mmio(vcpu_id, ipa, fsr, regs)) {
+            return false;
+        }
+    }
+
+    if (ls->is_load) {
+        uint64_t value = *reg;
+        if (ls->sign_extend && ls->size < 8) {
+            uint64_t sign = 1UL << (ls->size * 8 - 1);
+            value = (value ^ sign) - sign;
+        }
+        if (!ls->is_64bit) {
+            value &= 0xffffffff;
+        }
+        *reg = value;
+        fault_regs_dirty(regs, reg);
+        /* Loads to the zero register are discarded */
+        wzr = 0;
+    }
+
+    return true;
+}
+
+/*
+ * The hardware only gives a valid syndrome for simple loads and stores, for
+ * anything else (e.g load/store pair or writing back to the base register) we
+ * read the instruction from the guest and decode it ourselves.
+ */
+static bool fault_handle_decoded_vm_exception(size_t vcpu_id, uintptr_t addr, seL4_UserContext *regs)
+{
+    uint64_t pc_ipa;
+    if (!vcpu_translate_va(vcpu_id, regs->pc, &pc_ipa)) {
+        LOG_VMM_ERR("cannot decode fault on address 0x%lx, could not translate PC 0x%lx\n", addr, regs->pc);
+        return false;
+    }
+    uint32_t *instruction = guest_ram_ptr(pc_ipa, sizeof(uint32_t));
+    if (instruction == NULL) {
+        LOG_VMM_ERR("cannot decode fault on address 0x%lx, PC 0x%lx is not in guest RAM (see guest_set_ram)\n",
+                    addr, regs->pc);
+        return false;
+    }
+
+    decoded_load_store_t ls;
+    if (!decode_load_store(*instruction, &ls)) {
+        LOG_VMM_ERR("cannot emulate fault on address 0x%lx at PC 0x%lx\n", addr, regs->pc);
+        return false;
+    }
+
+    /* Work out every address before any transfer register can change the base */
+    uint64_t xn = fault_get_xn_or_sp(vcpu_id, regs, ls.rn);
+    uint64_t xm = ls.has_rm ? *decode_rt(ls.rm, regs) : 0;
+    uint64_t va = decode_load_store_address(&ls, xn, xm);
+
+    fault_decoding = true;
+    bool success = true;
+    for (size_t i = 0; i < ls.num_regs && success; i++) {
+        success = fault_emulate_decoded_access(vcpu_id, &ls, ls.rt[i], va + i * ls.size, regs);
+    }
+    fault_decoding = false;
+    if (!success) {
+        LOG_VMM_ERR("failed to emulate instruction 0x%x at PC 0x%lx faulting on address 0x%lx\n",
+                    *instruction, regs->pc, addr);
+        return false;
+    }
+
+    if (ls.writeback) {
+        fault_set_xn_or_sp(vcpu_id, regs, ls.rn, decode_load_store_writeback(&ls, xn));
+    }
+
+    return fault_advance_vcpu(vcpu_id, regs);
+}
+
+bool fault_handle_vm_exception(size_t vcpu_id)
+{
+    uintptr_t addr = microkit_mr_get(seL4_VMFault_Addr);
+    size_t fsr = microkit_mr_get(seL4_VMFault_FSR);
+
+    /*
+     * Handlers only ever need the PC and the transfer register, so unless
+     * the syndrome does not tell us which register that is, read up to Rt.
+     */
+    size_t count = SEL4_USER_CONTEXT_SIZE;
+    if (HSR_IS_SYNDROME_VALID(fsr)) {
+        seL4_Word *rt = decode_rt(HSR_SYNDROME_RT(fsr), &fault_regs.regs);
+        seL4_Word *start = (seL4_Word *)&fault_regs.regs;
+        if (rt >= start && rt < start + SEL4_USER_CONTEXT_SIZE) {
+            count = rt - start + 1;
+        } else {
+            count = FAULT_REGS_COUNT(pc);
+        }
+    }
+    seL4_UserContext *regs = fault_regs_get(vcpu_id, count);
+    if (regs == NULL) {
+        return false;
+    }
+
+    if (!HSR_IS_SYNDROME_VALID(fsr)) {
+        return fault_handle_decoded_vm_exception(vcpu_id, addr, regs);
+    }
+
+    return fault_handle_mmio(vcpu_id, addr, fsr, regs);
+}
+
 bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo) {
     size_t label = microkit_msginfo_get_label(msginfo);
     bool success = false;
+    uint64_t start = fault_stats_now();
+    /* Anything cached from a previous fault is stale now */
+    fault_regs_reset(vcpu_id);
     switch (label) {
         case seL4_Fault_VMFault:
             success = fault_handle_vm_exception(vcpu_id);
@@ -426,6 +745,8 @@ bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo) {
             vcpu_print_regs(vcpu_id);
     }
 
+    fault_stats_record_fault(label, fault_stats_now() - start);
+
     if (!success) {
         LOG_VMM_ERR("Failed to handle %s fault\n", fault_to_string(label));
     }
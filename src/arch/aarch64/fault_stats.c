@@ -0,0 +1,229 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/arch/aarch64/fault.h>
+#include <libvmm/arch/aarch64/fault_stats.h>
+
+#if defined(FAULT_STATS)
+
+/* Number of fault labels tracked, anything larger is counted in the last one */
+#define FAULT_STATS_NUM_LABELS 16
+/* Handling times are bucketed by powers of two */
+#define FAULT_STATS_NUM_BUCKETS 32
+
+/* Number of regions and addresses tracked, define before building to change */
+#ifndef FAULT_STATS_MAX_REGIONS
+#define FAULT_STATS_MAX_REGIONS 32
+#endif
+#ifndef FAULT_STATS_MAX_ADDRS
+#define FAULT_STATS_MAX_ADDRS 256
+#endif
+/* Number of the most accessed addresses printed by fault_stats_dump */
+#ifndef FAULT_STATS_DUMP_ADDRS
+#define FAULT_STATS_DUMP_ADDRS 16
+#endif
+
+struct fault_stats_hist {
+    uint64_t count;
+    uint64_t ticks;
+    uint64_t max;
+    uint64_t buckets[FAULT_STATS_NUM_BUCKETS];
+};
+
+struct fault_stats_region {
+    uintptr_t base;
+    struct fault_stats_hist hist;
+};
+
+struct fault_stats_addr {
+    uintptr_t addr;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t ticks;
+};
+
+static struct fault_stats_hist label_stats[FAULT_STATS_NUM_LABELS];
+static struct fault_stats_region region_stats[FAULT_STATS_MAX_REGIONS];
+static size_t num_region_stats;
+/* Open addressing hash table, an entry is in use when it has been accessed */
+static struct fault_stats_addr addr_stats[FAULT_STATS_MAX_ADDRS];
+/* Accesses that did not fit in the tables */
+static uint64_t regions_dropped;
+static uint64_t addrs_dropped;
+
+static void fault_stats_hist_record(struct fault_stats_hist *hist, uint64_t ticks)
+{
+    size_t bucket = (ticks == 0) ? 0 : 64 - __builtin_clzll(ticks);
+    if (bucket >= FAULT_STATS_NUM_BUCKETS) {
+        bucket = FAULT_STATS_NUM_BUCKETS - 1;
+    }
+    hist->count++;
+    hist->ticks += ticks;
+    if (ticks > hist->max) {
+        hist->max = ticks;
+    }
+    hist->buckets[bucket]++;
+}
+
+void fault_stats_record_fault(seL4_Word label, uint64_t ticks)
+{
+    if (label >= FAULT_STATS_NUM_LABELS) {
+        label = FAULT_STATS_NUM_LABELS - 1;
+    }
+    fault_stats_hist_record(&label_stats[label], ticks);
+}
+
+static struct fault_stats_region *fault_stats_find_region(uintptr_t base)
+{
+    for (size_t i = 0; i < num_region_stats; i++) {
+        if (region_stats[i].base == base) {
+            return &region_stats[i];
+        }
+    }
+    if (num_region_stats == FAULT_STATS_MAX_REGIONS) {
+        return NULL;
+    }
+    struct fault_stats_region *region = &region_stats[num_region_stats++];
+    region->base = base;
+    return region;
+}
+
+static struct fault_stats_addr *fault_stats_find_addr(uintptr_t addr)
+{
+    /* Device registers are at least word aligned, so drop the low bits before hashing */
+    size_t idx = ((addr >> 2) * 0x9E3779B97F4A7C15ULL) >> 32;
+    for (size_t i = 0; i < FAULT_STATS_MAX_ADDRS; i++) {
+        struct fault_stats_addr *entry = &addr_stats[(idx + i) % FAULT_STATS_MAX_ADDRS];
+        if (entry->addr == addr) {
+            return entry;
+        }
+        if (entry->reads == 0 && entry->writes == 0) {
+            entry->addr = addr;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void fault_stats_record_mmio(uintptr_t region_base, uintptr_t addr, bool is_write, uint64_t ticks)
+{
+    struct fault_stats_region *region = fault_stats_find_region(region_base);
+    if (region) {
+        fault_stats_hist_record(&region->hist, ticks);
+    } else {
+        regions_dropped++;
+    }
+
+    struct fault_stats_addr *entry = fault_stats_find_addr(addr);
+    if (entry) {
+        if (is_write) {
+            entry->writes++;
+        } else {
+            entry->reads++;
+        }
+        entry->ticks += ticks;
+    } else {
+        addrs_dropped++;
+    }
+}
+
+static void fault_stats_hist_dump(struct fault_stats_hist *hist)
+{
+    printf("    count: %lu, average: %lu ticks, max: %lu ticks\n",
+           hist->count, hist->ticks / hist->count, hist->max);
+    for (size_t i = 0; i < FAULT_STATS_NUM_BUCKETS; i++) {
+        if (hist->buckets[i] == 0) {
+            continue;
+        }
+        uint64_t low = (i == 0) ? 0 : 1ULL << (i - 1);
+        if (i == FAULT_STATS_NUM_BUCKETS - 1) {
+            printf("    [%lu..): %lu\n", low, hist->buckets[i]);
+        } else {
+            printf("    [%lu..%lu): %lu\n", low, 1ULL << i, hist->buckets[i]);
+        }
+    }
+}
+
+void fault_stats_dump(void)
+{
+    LOG_VMM("fault statistics, times are in ticks of the %s\n",
+#if defined(FAULT_STATS_PMU)
+            "PMU cycle counter");
+#else
+            "generic timer");
+#endif
+
+    for (size_t i = 0; i < FAULT_STATS_NUM_LABELS; i++) {
+        if (label_stats[i].count == 0) {
+            continue;
+        }
+        printf("%s faults (label 0x%lx):\n", fault_to_string(i), i);
+        fault_stats_hist_dump(&label_stats[i]);
+    }
+
+    for (size_t i = 0; i < num_region_stats; i++) {
+        printf("memory faults in region starting at 0x%lx:\n", region_stats[i].base);
+        fault_stats_hist_dump(&region_stats[i].hist);
+    }
+    if (regions_dropped) {
+        printf("memory faults in regions that were not tracked: %lu\n", regions_dropped);
+    }
+
+    /* Selection of the most accessed addresses, each pass picks the next most
+     * accessed one that is less than the previous pick. */
+    printf("most accessed addresses:\n");
+    struct fault_stats_addr *prev = NULL;
+    for (size_t n = 0; n < FAULT_STATS_DUMP_ADDRS; n++) {
+        struct fault_stats_addr *best = NULL;
+        for (size_t i = 0; i < FAULT_STATS_MAX_ADDRS; i++) {
+            struct fault_stats_addr *entry = &addr_stats[i];
+            uint64_t count = entry->reads + entry->writes;
+            if (count == 0) {
+                continue;
+            }
+            if (prev) {
+                uint64_t prev_count = prev->reads + prev->writes;
+                if (count > prev_count || (count == prev_count && entry <= prev)) {
+                    continue;
+                }
+            }
+            if (!best || count > best->reads + best->writes) {
+                best = entry;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        printf("    0x%lx: reads: %lu, writes: %lu, average: %lu ticks\n", best->addr, best->reads,
+               best->writes, best->ticks / (best->reads + best->writes));
+        prev = best;
+    }
+    if (addrs_dropped) {
+        printf("memory faults on addresses that were not tracked: %lu\n", addrs_dropped);
+    }
+}
+
+void fault_stats_reset(void)
+{
+    memset(label_stats, 0, sizeof(label_stats));
+    memset(region_stats, 0, sizeof(region_stats));
+    memset(addr_stats, 0, sizeof(addr_stats));
+    num_region_stats = 0;
+    regions_dropped = 0;
+    addrs_dropped = 0;
+}
+
+#else
+
+void fault_stats_dump(void)
+{
+    LOG_VMM("fault statistics are not available, build libvmm with FAULT_STATS defined\n");
+}
+
+void fault_stats_reset(void) {}
+
+#endif
@@ -8,6 +8,7 @@
 #include <libvmm/util/util.h>
 #include <libvmm/arch/aarch64/smc.h>
 #include <libvmm/arch/aarch64/psci.h>
+#include <libvmm/arch/aarch64/fault.h>
 
 // Values in this file are taken from:
 // SMC CALLING CONVENTION
@@ -58,6 +59,7 @@ static inline uint64_t smc_get_function_number(seL4_UserContext *regs)
 inline void smc_set_return_value(seL4_UserContext *u, uint64_t val)
 {
     u->x0 = val;
+    fault_regs_dirty(u, &u->x0);
 }
 
 uint64_t smc_get_arg(seL4_UserContext *u, uint64_t arg)
@@ -78,34 +80,38 @@ uint64_t smc_get_arg(seL4_UserContext *u, uint64_t arg)
 
 static void smc_set_arg(seL4_UserContext *u, size_t arg, size_t val)
 {
+    seL4_Word *reg;
     switch (arg) {
-        case 1: u->x1 = val; break;
-        case 2: u->x2 = val; break;
-        case 3: u->x3 = val; break;
-        case 4: u->x4 = val; break;
-        case 5: u->x5 = val; break;
-        case 6: u->x6 = val; break;
+        case 1: reg = &u->x1; break;
+        case 2: reg = &u->x2; break;
+        case 3: reg = &u->x3; break;
+        case 4: reg = &u->x4; break;
+        case 5: reg = &u->x5; break;
+        case 6: reg = &u->x6; break;
         default:
             LOG_VMM_ERR("trying to set SMC arg: 0x%lx, with val: 0x%lx, SMC only has 6 argument registers\n", arg, val);
+            return;
     }
+    *reg = val;
+    fault_regs_dirty(u, reg);
 }
 
 // @ivanv: print out which SMC call as a string we can't handle.
 bool handle_smc(size_t vcpu_id, uint32_t hsr)
 {
-    // @ivanv: An optimisation to be made is to store the TCB registers so we don't
-    // end up reading them multiple times
-    seL4_UserContext regs;
-    int err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + vcpu_id, false, 0, SEL4_USER_CONTEXT_SIZE, &regs);
-    assert(err == seL4_NoError);
+    /* The function ID and arguments are in x0-x6, nothing past that is needed */
+    seL4_UserContext *regs = fault_regs_get(vcpu_id, FAULT_REGS_COUNT(x6));
+    if (regs == NULL) {
+        return false;
+    }
 
-    size_t fn_number = smc_get_function_number(&regs);
-    smc_call_id_t service = smc_get_call(regs.x0);
+    size_t fn_number = smc_get_function_number(regs);
+    smc_call_id_t service = smc_get_call(regs->x0);
 
     switch (service) {
         case SMC_CALL_STD_SERVICE:
             if (fn_number < PSCI_MAX) {
-                return handle_psci(vcpu_id, &regs, fn_number, hsr);
+                return handle_psci(vcpu_id, regs, fn_number, hsr);
             }
             LOG_VMM_ERR("Unhandled SMC: standard service call %lu\n", fn_number);
             break;
@@ -6,8 +6,10 @@
 
 #include <microkit.h>
 #include <libvmm/vcpu.h>
+#include <libvmm/guest.h>
 #include <libvmm/util/util.h>
 
+#define SCTLR_EL1_M         (1 << 0)      /* Enable stage 1 address translation */
 #define SCTLR_EL1_UCI       (1 << 26)     /* Enable EL0 access to DC CVAU, DC CIVAC, DC CVAC,
                                            and IC IVAU in AArch64 state   */
 #define SCTLR_EL1_C         (1 << 2)      /* Enable data and unified caches */
@@ -25,6 +27,96 @@
 #define SCTLR_EL1_NATIVE   (SCTLR_EL1 | SCTLR_EL1_C | SCTLR_EL1_I | SCTLR_EL1_UCI)
 #define SCTLR_DEFAULT      SCTLR_EL1_NATIVE
 
+/* Stage 1 translation controls, only the 4KiB granule is supported */
+#define TCR_T0SZ(tcr)       ((tcr) & 0x3f)
+#define TCR_EPD0            (1UL << 7)
+#define TCR_TG0(tcr)        (((tcr) >> 14) & 0x3)
+#define TCR_TG0_4K          0
+#define TCR_T1SZ(tcr)       (((tcr) >> 16) & 0x3f)
+#define TCR_EPD1            (1UL << 23)
+#define TCR_TG1(tcr)        (((tcr) >> 30) & 0x3)
+#define TCR_TG1_4K          2
+
+#define TTBR_BADDR_MASK     0x0000fffffffffffeUL
+
+#define PTE_VALID           (1 << 0)
+#define PTE_TABLE           (1 << 1)
+#define PTE_ADDR_MASK       0x0000fffffffff000UL
+
+#define PAGE_BITS           12
+/* Number of address bits resolved by each level of the page table */
+#define PT_LEVEL_BITS       9
+#define PT_LAST_LEVEL       3
+
+bool vcpu_translate_va(size_t vcpu_id, uint64_t va, uint64_t *ipa) {
+    uint64_t sctlr = microkit_arm_vcpu_read_reg(vcpu_id, seL4_VCPUReg_SCTLR);
+    if (!(sctlr & SCTLR_EL1_M)) {
+        /* The MMU is off, addresses are not translated */
+        *ipa = va;
+        return true;
+    }
+
+    uint64_t tcr = microkit_arm_vcpu_read_reg(vcpu_id, seL4_VCPUReg_TCR);
+    /* Bit 55 selects between the upper (TTBR1) and lower (TTBR0) address ranges */
+    bool upper = (va >> 55) & 1;
+    size_t tsz = upper ? TCR_T1SZ(tcr) : TCR_T0SZ(tcr);
+    bool disabled = upper ? (tcr & TCR_EPD1) : (tcr & TCR_EPD0);
+    bool granule_4k = upper ? (TCR_TG1(tcr) == TCR_TG1_4K) : (TCR_TG0(tcr) == TCR_TG0_4K);
+    if (disabled) {
+        LOG_VMM_ERR("cannot translate 0x%lx, translation table walks are disabled for it\n", va);
+        return false;
+    }
+    if (!granule_4k) {
+        LOG_VMM_ERR("cannot translate 0x%lx, only the 4KiB translation granule is supported\n", va);
+        return false;
+    }
+
+    size_t va_bits = 64 - tsz;
+    if (va_bits <= PAGE_BITS || va_bits > 48) {
+        LOG_VMM_ERR("cannot translate 0x%lx, unsupported TCR value 0x%lx\n", va, tcr);
+        return false;
+    }
+    /* The bits above the address range must all be the same as bit 55 */
+    uint64_t top = va >> va_bits;
+    if (top != (upper ? (~0UL >> va_bits) : 0)) {
+        LOG_VMM_ERR("cannot translate 0x%lx, outside of the guest's address range\n", va);
+        return false;
+    }
+
+    uint64_t ttbr = microkit_arm_vcpu_read_reg(vcpu_id, upper ? seL4_VCPUReg_TTBR1 : seL4_VCPUReg_TTBR0);
+    uint64_t table = ttbr & TTBR_BADDR_MASK;
+    size_t level = PT_LAST_LEVEL + 1 - (va_bits - PAGE_BITS + PT_LEVEL_BITS - 1) / PT_LEVEL_BITS;
+    while (true) {
+        size_t shift = PAGE_BITS + PT_LEVEL_BITS * (PT_LAST_LEVEL - level);
+        /* The first level may resolve fewer bits than the rest */
+        size_t index_bits = (va_bits - shift < PT_LEVEL_BITS) ? va_bits - shift : PT_LEVEL_BITS;
+        size_t index = (va >> shift) & ((1UL << index_bits) - 1);
+        uint64_t *pte = guest_ram_ptr(table + index * sizeof(uint64_t), sizeof(uint64_t));
+        if (pte == NULL) {
+            LOG_VMM_ERR("cannot translate 0x%lx, page table at 0x%lx is not in guest RAM\n", va, table);
+            return false;
+        }
+        uint64_t desc = *(volatile uint64_t *)pte;
+        if (!(desc & PTE_VALID)) {
+            LOG_VMM_ERR("cannot translate 0x%lx, it is not mapped by the guest\n", va);
+            return false;
+        }
+        if (level < PT_LAST_LEVEL && (desc & PTE_TABLE)) {
+            table = desc & PTE_ADDR_MASK;
+            level++;
+            continue;
+        }
+        /* Blocks are only allowed at levels 1 and 2, and the last level must be pages */
+        if (level == 0 || (level == PT_LAST_LEVEL && !(desc & PTE_TABLE))) {
+            LOG_VMM_ERR("cannot translate 0x%lx, invalid descriptor 0x%lx at level %lu\n", va, desc, level);
+            return false;
+        }
+        uint64_t offset_mask = (1UL << shift) - 1;
+        *ipa = (desc & PTE_ADDR_MASK & ~offset_mask) | (va & offset_mask);
+        return true;
+    }
+}
+
 void vcpu_reset(size_t vcpu_id) {
     // @ivanv this is an incredible amount of system calls
     // Reset registers
@@ -35,7 +35,7 @@ bool fault_handle_vgic_maintenance(size_t vcpu_id)
     // @ivanv: Revisit and make sure it's still correct.
     vgic_vcpu_t *vgic_vcpu = get_vgic_vcpu(&vgic, vcpu_id);
     assert(vgic_vcpu);
-    assert((idx >= 0) && (idx < ARRAY_SIZE(vgic_vcpu->lr_shadow)));
+    assert((idx >= 0) && (idx < vgic.num_list_regs));
     struct virq_handle *slot = &vgic_vcpu->lr_shadow[idx];
     assert(slot->virq != VIRQ_INVALID);
     struct virq_handle lr_virq = *slot;
@@ -47,7 +47,8 @@ bool fault_handle_vgic_maintenance(size_t vcpu_id)
     set_pending(vgic_get_dist(vgic.registers), lr_virq.virq, false, vcpu_id);
     virq_ack(vcpu_id, &lr_virq);
     /* Check the overflow list for pending IRQs */
-    struct virq_handle *virq = vgic_irq_dequeue(&vgic, vcpu_id);
+    int priority;
+    struct virq_handle *virq = vgic_irq_dequeue(&vgic, vcpu_id, &priority);
 
 #if defined(GIC_V2)
     int group = 0;
@@ -58,7 +59,7 @@ bool fault_handle_vgic_maintenance(size_t vcpu_id)
 #endif
 
     if (virq) {
-        success = vgic_vcpu_load_list_reg(&vgic, vcpu_id, idx, group, virq);
+        success = vgic_vcpu_load_list_reg(&vgic, vcpu_id, idx, group, virq, priority);
     }
 
     if (!success) {
@@ -69,6 +70,26 @@ bool fault_handle_vgic_maintenance(size_t vcpu_id)
     return success;
 }
 
+void vgic_probe_list_regs(size_t vcpu_id)
+{
+    /* Injecting with an LR index no GIC supports makes the kernel reply with a
+     * range error that holds the highest valid index, without injecting anything. */
+    seL4_Error err = seL4_ARM_VCPU_InjectIRQ(BASE_VCPU_CAP + vcpu_id, 0, 0, 0, 0xff);
+    if (err != seL4_RangeError) {
+        LOG_VMM_ERR("Failed to probe number of GIC list registers (error %d), assuming %d\n", err,
+                    DEFAULT_NUM_LIST_REGS);
+        vgic.num_list_regs = DEFAULT_NUM_LIST_REGS;
+        return;
+    }
+
+    int num_list_regs = seL4_GetMR(1) + 1;
+    if (num_list_regs > MAX_LIST_REGS) {
+        num_list_regs = MAX_LIST_REGS;
+    }
+    vgic.num_list_regs = num_list_regs;
+    LOG_VMM("GIC has %d list registers\n", vgic.num_list_regs);
+}
+
 // @ivanv: maybe this shouldn't be here?
 bool vgic_register_irq(size_t vcpu_id, int virq_num, virq_ack_fn_t ack_fn, void *ack_data) {
     assert(virq_num >= 0 && virq_num != VIRQ_INVALID);
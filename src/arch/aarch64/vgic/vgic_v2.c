@@ -115,18 +115,39 @@ void vgic_init()
     for (int i = 0; i < NUM_VCPU_LOCAL_VIRQS; i++) {
         vgic.vgic_vcpu[GUEST_VCPU_ID].local_virqs[i].virq = VIRQ_INVALID;
     }
-    for (int i = 0; i < NUM_LIST_REGS; i++) {
+    for (int i = 0; i < MAX_LIST_REGS; i++) {
         vgic.vgic_vcpu[GUEST_VCPU_ID].lr_shadow[i].virq = VIRQ_INVALID;
     }
-    for (int i = 0; i < MAX_IRQ_QUEUE_LEN; i++) {
-        vgic.vgic_vcpu[GUEST_VCPU_ID].irq_queue.irqs[i] = NULL;
-    }
+    vgic.num_list_regs = DEFAULT_NUM_LIST_REGS;
+    vgic_irq_queue_init(&vgic.vgic_vcpu[GUEST_VCPU_ID].irq_queue);
     for (int i = 0; i < NUM_SLOTS_SPI_VIRQ; i++) {
         vgic.vspis[i].virq = VIRQ_INVALID;
         vgic.vspis[i].ack_fn = NULL;
         vgic.vspis[i].ack_data = NULL;
     }
+    virq_spi_slots_init(&vgic);
     vgic.registers = &dist;
     memset(vgic.registers, 0, sizeof(struct gic_dist_map));
     vgic_dist_reset(vgic_get_dist(vgic.registers));
 }
+
+bool vgic_dist_shadow_init(void *shadow)
+{
+#if GUEST_NUM_VCPUS == 1
+    static_assert(sizeof(struct gic_dist_map) == GIC_DIST_SIZE,
+                  "distributor state must be laid out exactly like the distributor to be shadowed");
+    if ((uintptr_t)shadow % GIC_DIST_SIZE != 0) {
+        LOG_VMM_ERR("distributor shadow at 0x%lx is not page aligned\n", (uintptr_t)shadow);
+        return false;
+    }
+    /* Anything the VMM has set up so far carries over */
+    memcpy(shadow, vgic.registers, sizeof(struct gic_dist_map));
+    vgic.registers = shadow;
+
+    return true;
+#else
+    /* The banked SGI/PPI registers would need a different page for each vCPU */
+    LOG_VMM_ERR("distributor shadow is not supported with more than one vCPU\n");
+    return false;
+#endif
+}
@@ -75,6 +75,9 @@ static bool handle_vgic_redist_read_fault(size_t vcpu_id, vgic_t *vgic, uint64_t
         reg_ptr = (uint32_t *)(base_reg + (offset - GICR_IGROUPR0));
         reg = *reg_ptr;
         break;
+    case RANGE32(GICR_IPRIORITYR0, GICR_IPRIORITYRN):
+        reg = gic_dist->priority0[vcpu_id][(offset - GICR_IPRIORITYR0) / 4];
+        break;
     case RANGE32(GICR_ICFGR1, GICR_ICFGR1):
         base_reg = (uintptr_t) & (gic_dist->config[1]);
         reg_ptr = (uint32_t *)(base_reg + (offset - GICR_ICFGR1));
@@ -140,6 +143,7 @@ static bool handle_vgic_redist_write_fault(size_t vcpu_id, vgic_t *vgic, uint64_
         emulate_reg_write_access(regs, fault_addr, fsr, &gic_dist->active0[vcpu_id]);
         break;
     case RANGE32(GICR_IPRIORITYR0, GICR_IPRIORITYRN):
+        emulate_reg_write_access(regs, fault_addr, fsr, &gic_dist->priority0[vcpu_id][(offset - GICR_IPRIORITYR0) / 4]);
         break;
     default:
         LOG_VMM_ERR("Unknown register offset 0x%x, value: 0x%x\n", offset, fault_get_data(regs, fsr));
@@ -215,12 +219,15 @@ void vgic_init()
     for (int i = 0; i < NUM_SLOTS_SPI_VIRQ; i++) {
         vgic.vspis[i].virq = VIRQ_INVALID;
     }
+    virq_spi_slots_init(&vgic);
     for (int i = 0; i < NUM_VCPU_LOCAL_VIRQS; i++) {
         vgic.vgic_vcpu[GUEST_VCPU_ID].local_virqs[i].virq = VIRQ_INVALID;
     }
-    for (int i = 0; i < NUM_LIST_REGS; i++) {
+    for (int i = 0; i < MAX_LIST_REGS; i++) {
         vgic.vgic_vcpu[GUEST_VCPU_ID].lr_shadow[i].virq = VIRQ_INVALID;
     }
+    vgic.num_list_regs = DEFAULT_NUM_LIST_REGS;
+    vgic_irq_queue_init(&vgic.vgic_vcpu[GUEST_VCPU_ID].irq_queue);
     vgic.registers = &vgic_regs;
     vgic_regs.dist = &dist;
     vgic_regs.redist = &redist;
@@ -228,3 +235,10 @@ void vgic_init()
     vgic_dist_reset(&dist);
     vgic_redist_reset(&redist);
 }
+
+bool vgic_dist_shadow_init(void *shadow)
+{
+    /* The GICv3 distributor state does not follow the register layout */
+    LOG_VMM_ERR("distributor shadow is only supported for GICv2\n");
+    return false;
+}
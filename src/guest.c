@@ -3,6 +3,23 @@
 #include <libvmm/guest.h>
 #include <libvmm/util/util.h>
 
+/* Guest RAM, mapped into the VMM at the same address that the guest sees it at */
+static uintptr_t ram_start;
+static size_t ram_size;
+
+void guest_set_ram(uintptr_t guest_ram_vaddr, size_t guest_ram_size) {
+    ram_start = guest_ram_vaddr;
+    ram_size = guest_ram_size;
+}
+
+void *guest_ram_ptr(uintptr_t addr, size_t size) {
+    if (addr < ram_start || size > ram_size || addr - ram_start > ram_size - size) {
+        return NULL;
+    }
+
+    return (void *)addr;
+}
+
 bool guest_start(size_t boot_vcpu_id, uintptr_t kernel_pc, uintptr_t dtb, uintptr_t initrd) {
     /*
      * Set the TCB registers to what the virtual machine expects to be started with.
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2024, UNSW (ABN 57 195 873 179)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <libvmm/util/util.h>
+#include <libvmm/util/buddy.h>
+
+/* Marks a cell that is not the start of a free block */
+#define ORDER_NOT_FREE 0xff
+
+/* Order of the largest block that is aligned at cell and no bigger than count */
+static inline uint8_t block_order(uint32_t cell, uint32_t count)
+{
+    uint8_t order = 31 - __builtin_clz(count);
+    if (cell != 0 && CTZ(cell) < order) {
+        order = CTZ(cell);
+    }
+    return order;
+}
+
+static void free_list_insert(buddy_t *buddy, uint32_t cell, uint8_t order)
+{
+    uint32_t head = buddy->free_list[order];
+    buddy->next[cell] = head;
+    buddy->prev[cell] = BUDDY_NONE;
+    if (head != BUDDY_NONE) {
+        buddy->prev[head] = cell;
+    }
+    buddy->free_list[order] = cell;
+    buddy->order[cell] = order;
+    buddy->free_orders |= BIT_LOW(order);
+}
+
+static void free_list_remove(buddy_t *buddy, uint32_t cell)
+{
+    uint8_t order = buddy->order[cell];
+    uint32_t next = buddy->next[cell];
+    uint32_t prev = buddy->prev[cell];
+    if (prev != BUDDY_NONE) {
+        buddy->next[prev] = next;
+    } else {
+        buddy->free_list[order] = next;
+    }
+    if (next != BUDDY_NONE) {
+        buddy->prev[next] = prev;
+    }
+    if (buddy->free_list[order] == BUDDY_NONE) {
+        buddy->free_orders &= ~BIT_LOW(order);
+    }
+    buddy->order[cell] = ORDER_NOT_FREE;
+}
+
+/* Frees an aligned block of 2^order cells, merging it with its buddies */
+static void free_block(buddy_t *buddy, uint32_t cell, uint8_t order)
+{
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t other = cell ^ (1u << order);
+        if (other >= buddy->num_cells || buddy->order[other] != order) {
+            break;
+        }
+        free_list_remove(buddy, other);
+        if (other < cell) {
+            cell = other;
+        }
+        order++;
+    }
+    free_list_insert(buddy, cell, order);
+}
+
+/* Frees an arbitrary run of cells by splitting it into aligned blocks */
+static void free_range(buddy_t *buddy, uint32_t cell, uint32_t count)
+{
+    while (count > 0) {
+        uint8_t order = block_order(cell, count);
+        free_block(buddy, cell, order);
+        cell += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+/* Order of the smallest block that holds count cells */
+static inline uint8_t fit_order(uint32_t count)
+{
+    return count <= 1 ? 0 : 32 - __builtin_clz(count - 1);
+}
+
+void buddy_init(buddy_t *buddy,
+                uintptr_t base,
+                uint64_t cell_size,
+                uint32_t num_cells,
+                uint32_t *next,
+                uint32_t *prev,
+                uint8_t *order)
+{
+    buddy->base = base;
+    buddy->cell_size = cell_size;
+    buddy->num_cells = num_cells;
+    buddy->free_orders = 0;
+    buddy->next = next;
+    buddy->prev = prev;
+    buddy->order = order;
+
+    for (int i = 0; i <= BUDDY_MAX_ORDER; i++) {
+        buddy->free_list[i] = BUDDY_NONE;
+    }
+    for (uint32_t i = 0; i < num_cells; i++) {
+        order[i] = ORDER_NOT_FREE;
+    }
+
+    free_range(buddy, 0, num_cells);
+}
+
+bool buddy_full(buddy_t *buddy, uint32_t count)
+{
+    uint8_t order = fit_order(count);
+    return count == 0 ? false : (order > BUDDY_MAX_ORDER || (buddy->free_orders >> order) == 0);
+}
+
+bool buddy_alloc(buddy_t *buddy, uintptr_t *addr, uint32_t count)
+{
+    if (count == 0 || buddy_full(buddy, count)) {
+        return false;
+    }
+
+    uint8_t want = fit_order(count);
+    uint8_t order = want + CTZ(buddy->free_orders >> want);
+    uint32_t cell = buddy->free_list[order];
+    free_list_remove(buddy, cell);
+
+    /* Give back everything past the cells we were asked for */
+    free_range(buddy, cell + count, (1u << order) - count);
+
+    *addr = buddy->base + cell * buddy->cell_size;
+
+    return true;
+}
+
+void buddy_free(buddy_t *buddy, uintptr_t addr, uint32_t count)
+{
+    assert(addr >= buddy->base);
+    uint32_t cell = (addr - buddy->base) / buddy->cell_size;
+    assert(cell + count <= buddy->num_cells);
+
+    free_range(buddy, cell, count);
+}
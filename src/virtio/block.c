@@ -7,8 +7,8 @@
 #include <libvmm/virtio/virtq.h>
 #include <libvmm/virtio/mmio.h>
 #include <libvmm/virtio/block.h>
+#include <libvmm/virtio/block_sddf.h>
 #include <sddf/blk/queue.h>
-#include <sddf/util/fsmalloc.h>
 #include <sddf/util/ialloc.h>
 
 /* Uncomment this to enable debug logging */
@@ -22,16 +22,41 @@
 
 #define LOG_BLOCK_ERR(...) do{ printf("VIRTIO(BLOCK)|ERROR: "); printf(__VA_ARGS__); }while(0)
 
+/* Uncomment this to offer discard and write zeroes, the sDDF block server must
+ * understand BLK_REQ_DISCARD and BLK_REQ_WRITE_ZEROES, see block_sddf.h */
+// #define VIRTIO_BLK_DISCARD
+
+#if defined(VIRTIO_BLK_DISCARD)
+#define VIRTIO_BLK_DISCARD_FEATURES (BIT_LOW(VIRTIO_BLK_F_DISCARD) | BIT_LOW(VIRTIO_BLK_F_WRITE_ZEROES))
+#else
+#define VIRTIO_BLK_DISCARD_FEATURES 0
+#endif
+
+/* Features offered to the driver, which may accept any subset of them */
+#define VIRTIO_BLK_FEATURES_LOW (BIT_LOW(VIRTIO_BLK_F_FLUSH) | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE) \
+                                 | BIT_LOW(VIRTIO_BLK_F_SEG_MAX) | BIT_LOW(VIRTIO_BLK_F_SIZE_MAX) \
+                                 | BIT_LOW(VIRTIO_BLK_F_MQ) | VIRTIO_BLK_DISCARD_FEATURES)
+#define VIRTIO_BLK_FEATURES_HIGH BIT_HIGH(VIRTIO_F_VERSION_1)
+
+/* Each discard or write zeroes request becomes a single sDDF request, whose count is 16 bits */
+#define MAX_DISCARD_SECTORS (UINT16_MAX * (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE))
+
 static inline struct virtio_blk_device *device_state(struct virtio_device *dev)
 {
     return (struct virtio_blk_device *)dev->device_data;
 }
 
-static void virtio_blk_mmio_reset(struct virtio_device *dev)
-{
-    dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].ready = false;
-    dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].last_idx = 0;
-}
+/* Outcome of trying to hand a virtIO request to sDDF */
+typedef enum blk_req_result {
+    BLK_REQ_ENQUEUED,
+    BLK_REQ_FAILED,
+    /* A request type or option we do not support */
+    BLK_REQ_UNSUPPORTED,
+    /* Not enough sDDF resources right now, try again later */
+    BLK_REQ_DEFERRED,
+    /* Handled without going to sDDF */
+    BLK_REQ_COMPLETED,
+} blk_req_result_t;
 
 static int virtio_blk_mmio_get_device_features(struct virtio_device *dev, uint32_t *features)
 {
@@ -42,12 +67,11 @@ static int virtio_blk_mmio_get_device_features(struct virtio_device *dev, uint32
     switch (dev->data.DeviceFeaturesSel) {
     /* feature bits 0 to 31 */
     case 0:
-        *features = BIT_LOW(VIRTIO_BLK_F_FLUSH);
-        *features = *features | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE);
+        *features = VIRTIO_BLK_FEATURES_LOW;
         break;
     /* features bits 32 to 63 */
     case 1:
-        *features = BIT_HIGH(VIRTIO_F_VERSION_1);
+        *features = VIRTIO_BLK_FEATURES_HIGH;
         break;
     default:
         LOG_BLOCK_ERR("driver sets DeviceFeaturesSel to 0x%x, which doesn't make sense\n",
@@ -64,18 +88,15 @@ static int virtio_blk_mmio_set_driver_features(struct virtio_device *dev, uint32
        by the driver. */
     int success = 1;
 
-    uint32_t device_features = 0;
-    device_features = device_features | BIT_LOW(VIRTIO_BLK_F_FLUSH);
-    device_features = device_features | BIT_LOW(VIRTIO_BLK_F_BLK_SIZE);
-
     switch (dev->data.DriverFeaturesSel) {
     /* feature bits 0 to 31 */
     case 0:
-        success = (features == device_features);
+        /* The driver may accept any subset of what we offer */
+        success = ((features & ~VIRTIO_BLK_FEATURES_LOW) == 0);
         break;
     /* features bits 32 to 63 */
     case 1:
-        success = (features == BIT_HIGH(VIRTIO_F_VERSION_1));
+        success = (features == VIRTIO_BLK_FEATURES_HIGH);
         break;
     default:
         LOG_BLOCK_ERR("driver sets DriverFeaturesSel to 0x%x, which doesn't make sense\n",
@@ -116,13 +137,9 @@ static int virtio_blk_mmio_set_device_config(struct virtio_device *dev, uint32_t
     return 1;
 }
 
-static void virtio_blk_used_buffer(struct virtio_device *dev, uint16_t desc)
+static void virtio_blk_used_buffer(struct virtio_device *dev, int vq_idx, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
-    struct virtq_used_elem used_elem = {desc, 0};
-
-    virtq->used->ring[virtq->used->idx % virtq->num] = used_elem;
-    virtq->used->idx++;
+    virtio_mmio_vq_push(&dev->vqs[vq_idx], desc, 0);
 }
 
 static bool virtio_blk_virq_inject(struct virtio_device *dev)
@@ -140,248 +157,896 @@ static void virtio_blk_set_interrupt_status(struct virtio_device *dev,
     dev->data.InterruptStatus = used_buffer | (config_change << 1);
 }
 
-/* Set response to virtio request to error */
-static void virtio_blk_set_req_fail(struct virtio_device *dev, uint16_t desc)
+/* Returns the status byte of a request, which is the last byte of its descriptor chain */
+static uint8_t *virtio_blk_req_status(struct virtq *virtq, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
-
     uint16_t curr_virtio_desc = desc;
     for (; virtq->desc[curr_virtio_desc].flags & VIRTQ_DESC_F_NEXT;
          curr_virtio_desc = virtq->desc[curr_virtio_desc].next) {}
-    *((uint8_t *)virtq->desc[curr_virtio_desc].addr) = VIRTIO_BLK_S_IOERR;
+    struct virtq_desc *status_desc = &virtq->desc[curr_virtio_desc];
+    return (uint8_t *)(status_desc->addr + status_desc->len - 1);
 }
 
-static void virtio_blk_set_req_success(struct virtio_device *dev, uint16_t desc)
+/* Set response to virtio request to error */
+static void virtio_blk_set_req_fail(struct virtio_device *dev, int vq_idx, uint16_t desc)
 {
-    struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    *virtio_blk_req_status(virtq, desc) = VIRTIO_BLK_S_IOERR;
+}
 
-    uint16_t curr_virtio_desc = desc;
-    for (; virtq->desc[curr_virtio_desc].flags & VIRTQ_DESC_F_NEXT;
-         curr_virtio_desc = virtq->desc[curr_virtio_desc].next) {}
-    *((uint8_t *)virtq->desc[curr_virtio_desc].addr) = VIRTIO_BLK_S_OK;
+static void virtio_blk_set_req_unsupp(struct virtio_device *dev, int vq_idx, uint16_t desc)
+{
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    *virtio_blk_req_status(virtq, desc) = VIRTIO_BLK_S_UNSUPP;
 }
 
-static bool sddf_make_req_check(struct virtio_blk_device *state, uint16_t sddf_count)
+static void virtio_blk_set_req_success(struct virtio_device *dev, int vq_idx, uint16_t desc)
+{
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    *virtio_blk_req_status(virtq, desc) = VIRTIO_BLK_S_OK;
+}
+
+/*
+ * Checks the shape of a request's descriptor chain and works out how much data
+ * it carries. The first descriptor holds the request header and the last byte
+ * of the last descriptor is the status, everything in between is data and may
+ * be spread over any number of descriptors.
+ */
+static bool virtio_blk_req_data_size(struct virtq *virtq, uint16_t desc_head, uint32_t *size)
+{
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    if (desc->len < sizeof(struct virtio_blk_outhdr) || !(desc->flags & VIRTQ_DESC_F_NEXT)) {
+        return false;
+    }
+
+    uint64_t total = 0;
+    unsigned int num_descs = 1;
+    do {
+        /* Guard against a malformed chain that loops back on itself */
+        if (num_descs++ > virtq->num) {
+            return false;
+        }
+        desc = &virtq->desc[desc->next];
+        total += desc->len;
+    } while (desc->flags & VIRTQ_DESC_F_NEXT);
+
+    if (desc->len == 0 || total - 1 > UINT32_MAX) {
+        return false;
+    }
+    *size = total - 1;
+
+    return true;
+}
+
+/*
+ * Copies the data of a request between its descriptor chain and a contiguous
+ * buffer, gathering into the buffer for writes and scattering out of it for reads.
+ */
+static void virtio_blk_copy_req_data(struct virtq *virtq, uint16_t desc_head, uintptr_t buf, bool to_virtio)
+{
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    while (desc->flags & VIRTQ_DESC_F_NEXT) {
+        desc = &virtq->desc[desc->next];
+        uint32_t len = desc->len;
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            /* Don't touch the status byte */
+            len--;
+        }
+
+        if (to_virtio) {
+            memcpy((void *)desc->addr, (void *)buf, len);
+        } else {
+            memcpy((void *)buf, (void *)desc->addr, len);
+        }
+        buf += len;
+    }
+}
+
+/*
+ * Works out whether the sDDF server can transfer the data of a request directly
+ * to or from guest memory. This is the case when the data is contiguous, lies
+ * inside the zero-copy window and starts on a BLK_TRANSFER_SIZE boundary. If it
+ * can, returns the offset to give to sDDF.
+ */
+static bool virtio_blk_zero_copy_offset(struct virtio_blk_device *state, struct virtq *virtq, uint16_t desc_head,
+                                        uint64_t *offset)
+{
+    virtio_blk_zero_copy_t *zc = &state->zero_copy;
+    if (zc->size == 0) {
+        return false;
+    }
+
+    bool found = false;
+    uintptr_t start = 0;
+    uintptr_t end = 0;
+    struct virtq_desc *desc = &virtq->desc[desc_head];
+    while (desc->flags & VIRTQ_DESC_F_NEXT) {
+        desc = &virtq->desc[desc->next];
+        uint32_t len = desc->len;
+        if (!(desc->flags & VIRTQ_DESC_F_NEXT)) {
+            /* The status byte is not part of the data */
+            len--;
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        if (!found) {
+            start = desc->addr;
+            end = start;
+            found = true;
+        }
+        if (desc->addr != end) {
+            return false;
+        }
+        end += len;
+    }
+
+    if (!found || start < zc->guest_base || end > zc->guest_base + zc->size
+        || (start - zc->guest_base) % BLK_TRANSFER_SIZE != 0) {
+        return false;
+    }
+
+    *offset = zc->sddf_offset + (start - zc->guest_base);
+
+    return true;
+}
+
+/*
+ * Checks whether the sDDF resources needed for a request are available. If they
+ * are not, the request has to wait until responses from the server free some up.
+ */
+static bool sddf_make_req_check(struct virtio_blk_device *state, blk_queue_handle_t *queue_h, uint16_t sddf_count)
 {
     /* Check if ialloc is full, if data region is full, if req queue is full.
        If these all pass then this request can be handled successfully */
     if (ialloc_full(&state->ialloc)) {
-        LOG_BLOCK_ERR("Request bookkeeping array is full\n");
+        LOG_BLOCK("Request bookkeeping array is full\n");
         return false;
     }
 
-    if (blk_req_queue_full(&state->queue_h)) {
-        LOG_BLOCK_ERR("Request queue is full\n");
+    if (blk_req_queue_full(queue_h)) {
+        LOG_BLOCK("Request queue is full\n");
         return false;
     }
 
-    if (fsmalloc_full(&state->fsmalloc, sddf_count)) {
-        LOG_BLOCK_ERR("Data region is full\n");
+    if (buddy_full(&state->data_alloc, sddf_count)) {
+        LOG_BLOCK("Data region is full\n");
         return false;
     }
 
     return true;
 }
 
-static int virtio_blk_mmio_queue_notify(struct virtio_device *dev)
+/*
+ * Write-back cache for writes smaller than a BLK_TRANSFER_SIZE block.
+ *
+ * Rather than doing a read-modify-write with sDDF for each one, such writes are
+ * copied into a cached block and completed straight away. Each entry tracks which
+ * sectors it holds, so adjacent writes fill in the block without reading it.
+ * The rest of the block is only read when the entry has to be written back, which
+ * happens when the guest flushes or when the entry is needed for another block.
+ *
+ * The cache holds the latest data for the sectors it has, so reads returned by
+ * sDDF are overlaid with it and writes that bypass it update it. Loading, writing
+ * back or evicting an entry waits until no other sDDF reads or writes are in
+ * flight for its block, so those can never race with the cache.
+ */
+#define CACHE_OP_NONE 0
+#define CACHE_OP_LOAD 1
+#define CACHE_OP_WRITEBACK 2
+
+#define CACHE_SECTORS_PER_BLOCK (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE)
+#define CACHE_SECTORS_ALL ((uint8_t)((1u << CACHE_SECTORS_PER_BLOCK) - 1))
+static_assert(CACHE_SECTORS_PER_BLOCK <= 8, "Cache sector mask must fit in a uint8_t");
+
+/* Tracks sDDF reads and writes of [block, block + count) made on behalf of the guest */
+static void cache_inflight_update(struct virtio_blk_device *state, uint32_t block, uint32_t count, bool add)
+{
+    /* Past this many blocks every bucket has been counted once */
+    if (count > VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS) {
+        count = VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t *inflight = &state->cache.inflight[(block + i) % VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS];
+        if (add) {
+            (*inflight)++;
+        } else {
+            assert(*inflight > 0);
+            (*inflight)--;
+        }
+    }
+}
+
+static bool cache_block_idle(struct virtio_blk_device *state, uint32_t block)
 {
-    /* If multiqueue feature bit negotiated, should read which queue from dev->QueueNotify,
-       but for now we just assume it's the one and only default queue */
-    virtio_queue_handler_t *vq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ];
-    struct virtq *virtq = &vq->virtq;
+    return state->cache.inflight[block % VIRTIO_BLK_CACHE_INFLIGHT_BUCKETS] == 0;
+}
 
-    struct virtio_blk_device *state = device_state(dev);
+static void cache_mark_dirty(struct virtio_blk_device *state, virtio_blk_cache_entry_t *entry)
+{
+    uint64_t seq = ++state->cache.seq;
+    if (entry->dirty_seq == 0) {
+        entry->dirty_seq = seq;
+    }
+    entry->last_seq = seq;
+}
 
-    bool has_dropped = false; /* if any request has to be dropped due to any number of reasons, this becomes true */
+static bool cache_entry_in_range(virtio_blk_cache_entry_t *entry, uint32_t block, uint32_t count)
+{
+    return entry->in_use && entry->block >= block && entry->block - block < count;
+}
 
-    /* get next available request to be handled */
-    uint16_t idx = vq->last_idx;
+/* Copies the cached sectors of [block, block + count) over buf, which holds data read from sDDF */
+static void cache_overlay(struct virtio_blk_device *state, uint32_t block, uint32_t count, uintptr_t buf)
+{
+    for (int i = 0; i < VIRTIO_BLK_CACHE_ENTRIES; i++) {
+        virtio_blk_cache_entry_t *entry = &state->cache.entries[i];
+        if (!cache_entry_in_range(entry, block, count)) {
+            continue;
+        }
 
-    int err = 0;
-    LOG_BLOCK("------------- Driver notified device -------------\n");
-    for (; idx != virtq->avail->idx; idx++) {
-        uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
-
-        uint16_t curr_desc_head = desc_head;
-
-        /* Print out what the request type is */
-        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[curr_desc_head].addr;
-        LOG_BLOCK("----- Request type is 0x%x -----\n", virtio_req->type);
-
-        /* Parse different requests */
-        switch (virtio_req->type) {
-        /* There are three parts with each block request. The header, body (which contains the data) and reply. */
-        case VIRTIO_BLK_T_IN: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_IN\n");
-            LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
-
-            curr_desc_head = virtq->desc[curr_desc_head].next;
-            LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
-                      (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
-
-            /* Converting virtio sector number to sddf block number, we are rounding down */
-            uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
-            /* Converting bytes to the number of blocks, we are rounding up */
-            uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
-
-            if (!sddf_make_req_check(state, sddf_count)) {
-                virtio_blk_set_req_fail(dev, desc_head);
-                has_dropped = true;
-                break;
+        uintptr_t dest = buf + (entry->block - block) * BLK_TRANSFER_SIZE;
+        if (entry->sectors == CACHE_SECTORS_ALL) {
+            memcpy((void *)dest, (void *)entry->buf, BLK_TRANSFER_SIZE);
+            continue;
+        }
+        for (int s = 0; s < CACHE_SECTORS_PER_BLOCK; s++) {
+            if (entry->sectors & BIT_LOW(s)) {
+                memcpy((void *)(dest + s * VIRTIO_BLK_SECTOR_SIZE),
+                       (void *)(entry->buf + s * VIRTIO_BLK_SECTOR_SIZE),
+                       VIRTIO_BLK_SECTOR_SIZE);
             }
+        }
+    }
+}
 
-            /* Allocate data buffer from data region based on sddf_count */
-            uintptr_t sddf_data;
-            fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
-
-            /* Bookkeep the virtio sddf block size translation */
-            uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-            uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
-
-            /* Book keep the request */
-            uint32_t req_id;
-            ialloc_alloc(&state->ialloc, &req_id);
-            state->reqbk[req_id] = (reqbk_t) {
-                desc_head, sddf_data, sddf_count, sddf_block_number,
-                           virtio_data, virtio_data_size, 0
-            };
-
-            uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-            err = blk_enqueue_req(&state->queue_h, READ_BLOCKS, offset, sddf_block_number, sddf_count, req_id);
-            assert(!err);
-            break;
-        }
-        case VIRTIO_BLK_T_OUT: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_OUT\n");
-            LOG_BLOCK("Sector (read/write offset) is %d\n", virtio_req->sector);
-
-            curr_desc_head = virtq->desc[curr_desc_head].next;
-            LOG_BLOCK("Descriptor index is %d, Descriptor flags are: 0x%x, length is 0x%x\n", curr_desc_head,
-                      (uint16_t)virtq->desc[curr_desc_head].flags, virtq->desc[curr_desc_head].len);
-
-            /* Converting virtio sector number to sddf block number, we are rounding down */
-            uint32_t sddf_block_number = (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) / BLK_TRANSFER_SIZE;
-            /* Converting bytes to the number of blocks, we are rounding up */
-            uint16_t sddf_count = (virtq->desc[curr_desc_head].len + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
-
-            bool aligned = ((virtio_req->sector % (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE)) == 0);
-
-            /* If the write request is not aligned to the sddf transfer size, we need to do a read-modify-write:
-            we need to first read the surrounding aligned memory, overwrite that read memory on the unaligned areas
-            we want write to, and then write the entire memory back to disk. */
-            if (!aligned) {
-                if (!sddf_make_req_check(state, sddf_count)) {
-                    virtio_blk_set_req_fail(dev, desc_head);
-                    has_dropped = true;
-                    break;
-                }
+/*
+ * Brings the cached blocks of [block, block + count) up to date with buf, which is
+ * about to be written by sDDF. A buf of 0 means the blocks are being zeroed.
+ */
+static void cache_write_through(struct virtio_blk_device *state, uint32_t block, uint32_t count, uintptr_t buf)
+{
+    for (int i = 0; i < VIRTIO_BLK_CACHE_ENTRIES; i++) {
+        virtio_blk_cache_entry_t *entry = &state->cache.entries[i];
+        if (!cache_entry_in_range(entry, block, count)) {
+            continue;
+        }
 
-                /* Allocate data buffer from data region based on sddf_count */
-                uintptr_t sddf_data;
-                fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
-
-                /* Bookkeep the virtio sddf block size translation */
-                uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-                uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
-
-                /* Book keep the request */
-                uint32_t req_id;
-                ialloc_alloc(&state->ialloc, &req_id);
-                state->reqbk[req_id] = (reqbk_t) {
-                    desc_head, sddf_data, sddf_count, sddf_block_number,
-                               virtio_data, virtio_data_size, aligned
-                };
-
-                uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-                err = blk_enqueue_req(&state->queue_h, READ_BLOCKS, offset, sddf_block_number, sddf_count, req_id);
-                assert(!err);
-            } else {
-                if (!sddf_make_req_check(state, sddf_count)) {
-                    virtio_blk_set_req_fail(dev, desc_head);
-                    has_dropped = true;
-                    break;
-                }
+        if (!entry->busy && entry->dirty_seq == 0) {
+            /* Nothing in the entry that the write does not replace */
+            entry->in_use = false;
+            continue;
+        }
 
-                /* Allocate data buffer from data region based on sddf_count */
-                uintptr_t sddf_data;
-                fsmalloc_alloc(&state->fsmalloc, &sddf_data, sddf_count);
+        if (buf == 0) {
+            memset((void *)entry->buf, 0, BLK_TRANSFER_SIZE);
+        } else {
+            memcpy((void *)entry->buf, (void *)(buf + (entry->block - block) * BLK_TRANSFER_SIZE), BLK_TRANSFER_SIZE);
+        }
+        entry->sectors = CACHE_SECTORS_ALL;
+        cache_mark_dirty(state, entry);
+    }
+}
+
+/*
+ * Starts writing back a dirty entry. If the entry does not hold the whole block,
+ * the rest of it is read in first and the write starts once that completes.
+ * Returns true if a request was enqueued on the sDDF queue for vq_idx.
+ */
+static bool cache_start_writeback(struct virtio_blk_device *state, int vq_idx, uint16_t entry_idx)
+{
+    virtio_blk_cache_entry_t *entry = &state->cache.entries[entry_idx];
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+
+    if (entry->busy || entry->dirty_seq == 0 || !cache_block_idle(state, entry->block)) {
+        return false;
+    }
+    if (ialloc_full(&state->ialloc) || blk_req_queue_full(queue_h)) {
+        return false;
+    }
 
-                /* Bookkeep the virtio sddf block size translation */
-                uintptr_t virtio_data = sddf_data + (virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE) % BLK_TRANSFER_SIZE;
-                uintptr_t virtio_data_size = virtq->desc[curr_desc_head].len;
+    uint32_t req_id;
+    int err;
+    if (entry->sectors != CACHE_SECTORS_ALL) {
+        uintptr_t sddf_data;
+        if (!buddy_alloc(&state->data_alloc, &sddf_data, 1)) {
+            return false;
+        }
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            0, sddf_data, 1, entry->block, 0, 0, false, false, REQBK_NONE, CACHE_OP_LOAD, entry_idx
+        };
+        err = blk_enqueue_req(queue_h, READ_BLOCKS, sddf_data - state->data_region, entry->block, 1, req_id);
+    } else {
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            0, entry->buf, 1, entry->block, 0, 0, true, false, REQBK_NONE, CACHE_OP_WRITEBACK, entry_idx
+        };
+        entry->writeback_seq = entry->dirty_seq;
+        entry->dirty_seq = 0;
+        err = blk_enqueue_req(queue_h, WRITE_BLOCKS, entry->buf - state->data_region, entry->block, 1, req_id);
+    }
+    assert(!err);
+    entry->busy = true;
+    if (!blk_req_queue_plugged(queue_h)) {
+        microkit_notify(state->server_ch);
+    }
 
-                /* Book keep the request */
-                uint32_t req_id;
-                ialloc_alloc(&state->ialloc, &req_id);
-                state->reqbk[req_id] = (reqbk_t) {
-                    desc_head, sddf_data, sddf_count, sddf_block_number,
-                               virtio_data, virtio_data_size, aligned
-                };
+    LOG_BLOCK("Cache %s of block %d\n", entry->sectors != CACHE_SECTORS_ALL ? "load" : "writeback", entry->block);
 
-                /* Copy data from virtio buffer to data buffer, create sddf write request and initialise it with data buffer */
-                memcpy((void *)sddf_data, (void *)virtq->desc[curr_desc_head].addr, virtq->desc[curr_desc_head].len);
+    return true;
+}
 
-                uintptr_t offset = sddf_data - ((struct virtio_blk_device *)dev->device_data)->data_region;
-                err = blk_enqueue_req(&state->queue_h, WRITE_BLOCKS, offset, sddf_block_number, sddf_count, req_id);
-                assert(!err);
+static void cache_handle_resp(struct virtio_blk_device *state, reqbk_t *data, bool success)
+{
+    virtio_blk_cache_entry_t *entry = &state->cache.entries[data->cache_entry];
+    entry->busy = false;
+    entry->error = !success;
+
+    if (data->cache_op == CACHE_OP_LOAD) {
+        if (success) {
+            /* Fill in the sectors that have not been written */
+            for (int s = 0; s < CACHE_SECTORS_PER_BLOCK; s++) {
+                if (!(entry->sectors & BIT_LOW(s))) {
+                    memcpy((void *)(entry->buf + s * VIRTIO_BLK_SECTOR_SIZE),
+                           (void *)(data->sddf_data + s * VIRTIO_BLK_SECTOR_SIZE),
+                           VIRTIO_BLK_SECTOR_SIZE);
+                }
             }
-            break;
+            entry->sectors = CACHE_SECTORS_ALL;
         }
-        case VIRTIO_BLK_T_FLUSH: {
-            LOG_BLOCK("Request type is VIRTIO_BLK_T_FLUSH\n");
+        buddy_free(&state->data_alloc, data->sddf_data, 1);
+    } else {
+        if (!success) {
+            /* Everything the writeback covered is still dirty */
+            entry->dirty_seq = entry->writeback_seq;
+        }
+        entry->writeback_seq = 0;
+    }
+}
 
-            if (!sddf_make_req_check(state, 0)) {
-                virtio_blk_set_req_fail(dev, desc_head);
-                has_dropped = true;
-                break;
+/*
+ * Returns the entry caching block, taking over the least recently written clean
+ * entry if it is not cached yet. If every entry is dirty, starts writing one back
+ * and returns NULL.
+ */
+static virtio_blk_cache_entry_t *cache_get(struct virtio_blk_device *state, int vq_idx, uint32_t block)
+{
+    virtio_blk_cache_entry_t *victim = NULL;
+    int oldest_dirty = -1;
+    for (int i = 0; i < VIRTIO_BLK_CACHE_ENTRIES; i++) {
+        virtio_blk_cache_entry_t *entry = &state->cache.entries[i];
+        if (entry->in_use && entry->block == block) {
+            return entry;
+        }
+        if (!entry->in_use) {
+            victim = entry;
+        } else if (!entry->busy && cache_block_idle(state, entry->block)) {
+            if (entry->dirty_seq == 0) {
+                if (victim == NULL || (victim->in_use && entry->last_seq < victim->last_seq)) {
+                    victim = entry;
+                }
+            } else if (oldest_dirty < 0 || entry->last_seq < state->cache.entries[oldest_dirty].last_seq) {
+                oldest_dirty = i;
             }
+        }
+    }
 
-            /* Book keep the request */
-            uint32_t req_id;
-            ialloc_alloc(&state->ialloc, &req_id);
-            /* except for virtio desc, nothing else needs to be retrieved later
-             * so leave as 0 */
-            state->reqbk[req_id] = (reqbk_t) {
-                desc_head, 0, 0, 0, 0, 0
-            };
+    if (victim == NULL) {
+        if (oldest_dirty >= 0) {
+            cache_start_writeback(state, vq_idx, oldest_dirty);
+        }
+        return NULL;
+    }
 
-            err = blk_enqueue_req(&state->queue_h, FLUSH, 0, 0, 0, req_id);
-            break;
+    victim->in_use = true;
+    victim->busy = false;
+    victim->error = false;
+    victim->sectors = 0;
+    victim->block = block;
+    victim->dirty_seq = 0;
+    victim->writeback_seq = 0;
+
+    return victim;
+}
+
+/*
+ * Writes back every entry holding writes with a sequence number up to seq.
+ * Returns true once they have all reached sDDF. failed is set if writing one
+ * of them back failed.
+ */
+static bool cache_flushed(struct virtio_blk_device *state, int vq_idx, uint64_t seq, bool *failed)
+{
+    bool flushed = true;
+    for (int i = 0; i < VIRTIO_BLK_CACHE_ENTRIES; i++) {
+        virtio_blk_cache_entry_t *entry = &state->cache.entries[i];
+        bool dirty = entry->dirty_seq != 0 && entry->dirty_seq <= seq;
+        bool writing = entry->writeback_seq != 0 && entry->writeback_seq <= seq;
+        if (!entry->in_use || (!dirty && !writing)) {
+            continue;
         }
-        default: {
-            LOG_BLOCK_ERR(
-                "Handling VirtIO block request, but virtIO request type is not recognised: %d\n",
-                virtio_req->type);
-            virtio_blk_set_req_fail(dev, desc_head);
-            has_dropped = true;
-            break;
+
+        if (entry->error && !entry->busy) {
+            entry->error = false;
+            *failed = true;
+            continue;
         }
+
+        flushed = false;
+        if (dirty) {
+            cache_start_writeback(state, vq_idx, i);
         }
     }
 
-    /* Update virtq index to the next available request to be handled */
-    vq->last_idx = idx;
+    return flushed;
+}
+
+/* Puts a write of size bytes at block_offset within block into the cache */
+static bool virtio_blk_cache_write(struct virtio_device *dev, int vq_idx, uint16_t desc_head,
+                                   uint32_t block, uintptr_t block_offset, uint32_t size)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    virtio_blk_cache_entry_t *entry = cache_get(state, vq_idx, block);
+    if (entry == NULL) {
+        return false;
+    }
+
+    virtio_blk_copy_req_data(&dev->vqs[vq_idx].virtq, desc_head, entry->buf + block_offset, false);
+    uint8_t first = block_offset / VIRTIO_BLK_SECTOR_SIZE;
+    uint8_t num = size / VIRTIO_BLK_SECTOR_SIZE;
+    entry->sectors |= ((1u << num) - 1) << first;
+    cache_mark_dirty(state, entry);
+
+    LOG_BLOCK("Cached write to block %d, sectors are now 0x%x\n", block, entry->sectors);
+
+    return true;
+}
+
+/*
+ * Zeroes the parts of the byte range [start, end) that only cover part of a block
+ * in the cache. Returns false if there was no room in the cache, in which case it
+ * should be tried again later.
+ */
+static bool virtio_blk_cache_zero(struct virtio_blk_device *state, int vq_idx, uint64_t start, uint64_t end)
+{
+    for (uint64_t block_start = start - start % BLK_TRANSFER_SIZE; block_start < end;
+         block_start += BLK_TRANSFER_SIZE) {
+        uint64_t zero_start = block_start > start ? block_start : start;
+        uint64_t zero_end = block_start + BLK_TRANSFER_SIZE < end ? block_start + BLK_TRANSFER_SIZE : end;
+        if (zero_end - zero_start == BLK_TRANSFER_SIZE) {
+            continue;
+        }
+
+        virtio_blk_cache_entry_t *entry = cache_get(state, vq_idx, block_start / BLK_TRANSFER_SIZE);
+        if (entry == NULL) {
+            return false;
+        }
+
+        uint64_t offset = zero_start - block_start;
+        memset((void *)(entry->buf + offset), 0, zero_end - zero_start);
+        uint8_t first = offset / VIRTIO_BLK_SECTOR_SIZE;
+        uint8_t num = (zero_end - zero_start) / VIRTIO_BLK_SECTOR_SIZE;
+        entry->sectors |= ((1u << num) - 1) << first;
+        cache_mark_dirty(state, entry);
+    }
+
+    return true;
+}
+
+/*
+ * Sets up the sDDF request for a read or write. Writes within a single sDDF block
+ * go to the write cache if there is room. Reads, as well as other writes that do
+ * not cover whole sDDF blocks, start with a read of all the blocks touched by the
+ * request. For unaligned writes the rest of the read-modify-write happens once
+ * the read completes, see virtio_blk_handle_resp.
+ */
+static blk_req_result_t virtio_blk_data_req(struct virtio_device *dev, int vq_idx, uint16_t desc_head,
+                                            struct virtio_blk_outhdr *virtio_req)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+    bool write = virtio_req->type == VIRTIO_BLK_T_OUT;
+
+    uint32_t size;
+    if (!virtio_blk_req_data_size(virtq, desc_head, &size) || size == 0) {
+        LOG_BLOCK_ERR("Malformed descriptor chain for request at descriptor %d\n", desc_head);
+        return BLK_REQ_FAILED;
+    }
+
+    uint64_t start = virtio_req->sector * VIRTIO_BLK_SECTOR_SIZE;
+    /* Converting virtio sector number to sddf block number, we are rounding down */
+    uint32_t sddf_block_number = start / BLK_TRANSFER_SIZE;
+    uintptr_t block_offset = start % BLK_TRANSFER_SIZE;
+    /* Converting bytes to the number of blocks, we are rounding up. This includes
+     * the part of the first block before the start of the request. */
+    uint64_t sddf_count = (block_offset + size + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE;
+    bool aligned = block_offset == 0 && (size % BLK_TRANSFER_SIZE) == 0;
+
+    LOG_BLOCK("Sector (read/write offset) is %d, size is 0x%x, sddf_count is %d\n", virtio_req->sector, size, sddf_count);
+
+    if (write && !aligned && sddf_count == 1 && size % VIRTIO_BLK_SECTOR_SIZE == 0
+        && virtio_blk_cache_write(dev, vq_idx, desc_head, sddf_block_number, block_offset, size)) {
+        return BLK_REQ_COMPLETED;
+    }
+
+    uint64_t zero_copy_offset;
+    if (aligned && virtio_blk_zero_copy_offset(state, virtq, desc_head, &zero_copy_offset)) {
+        if (!sddf_make_req_check(state, queue_h, 0)) {
+            return BLK_REQ_DEFERRED;
+        }
+
+        LOG_BLOCK("Zero-copy request at offset 0x%lx\n", zero_copy_offset);
+
+        /* The data is contiguous in guest memory */
+        uintptr_t virtio_data = zero_copy_offset - state->zero_copy.sddf_offset + state->zero_copy.guest_base;
+        if (write) {
+            cache_write_through(state, sddf_block_number, sddf_count, virtio_data);
+        }
+        cache_inflight_update(state, sddf_block_number, sddf_count, true);
+
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        state->reqbk[req_id] = (reqbk_t) {
+            desc_head, 0, sddf_count, sddf_block_number,
+                       virtio_data, size, aligned, true
+        };
+        state->reqbk[req_id].generation = state->generation;
+
+        int err = blk_enqueue_req(queue_h, write ? WRITE_BLOCKS : READ_BLOCKS, zero_copy_offset,
+                                  sddf_block_number, sddf_count, req_id);
+        assert(!err);
+
+        return BLK_REQ_ENQUEUED;
+    }
+
+    /* A request that could never fit would wait forever, fail it instead */
+    if (sddf_count > state->sddf_data_buffers) {
+        LOG_BLOCK_ERR("Request of 0x%x bytes does not fit in the data region\n", size);
+        return BLK_REQ_FAILED;
+    }
+
+    if (!sddf_make_req_check(state, queue_h, sddf_count)) {
+        return BLK_REQ_DEFERRED;
+    }
+
+    /* Allocate data buffer from data region based on sddf_count */
+    uintptr_t sddf_data;
+    buddy_alloc(&state->data_alloc, &sddf_data, sddf_count);
+
+    /* Bookkeep the virtio sddf block size translation */
+    uintptr_t virtio_data = sddf_data + block_offset;
+
+    /* Book keep the request */
+    uint32_t req_id;
+    ialloc_alloc(&state->ialloc, &req_id);
+    state->reqbk[req_id] = (reqbk_t) {
+        desc_head, sddf_data, sddf_count, sddf_block_number,
+                   virtio_data, size, aligned
+    };
+    state->reqbk[req_id].generation = state->generation;
+
+    blk_request_code_t code = READ_BLOCKS;
+    if (write && aligned) {
+        /* Gather data from the virtio buffers into the data buffer */
+        virtio_blk_copy_req_data(virtq, desc_head, sddf_data, false);
+        cache_write_through(state, sddf_block_number, sddf_count, sddf_data);
+        code = WRITE_BLOCKS;
+    }
+    cache_inflight_update(state, sddf_block_number, sddf_count, true);
+
+    uintptr_t offset = sddf_data - state->data_region;
+    int err = blk_enqueue_req(queue_h, code, offset, sddf_block_number, sddf_count, req_id);
+    assert(!err);
+
+    return BLK_REQ_ENQUEUED;
+}
+
+/*
+ * Sets up the sDDF request for a discard or write zeroes. sDDF only deals with
+ * whole blocks, so for write zeroes the parts of blocks at either end of the
+ * range are zeroed in the write cache. Those parts are left alone for a discard,
+ * which is only a hint.
+ */
+static blk_req_result_t virtio_blk_discard_req(struct virtio_device *dev, int vq_idx, uint16_t desc_head,
+                                               struct virtio_blk_outhdr *virtio_req)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+    bool zeroes = virtio_req->type == VIRTIO_BLK_T_WRITE_ZEROES;
+
+    /* We only advertise support for a single segment */
+    struct virtio_blk_discard_write_zeroes seg;
+    uint32_t size;
+    if (!virtio_blk_req_data_size(virtq, desc_head, &size) || size != sizeof(seg)) {
+        LOG_BLOCK_ERR("Malformed discard or write zeroes request at descriptor %d\n", desc_head);
+        return BLK_REQ_FAILED;
+    }
+    virtio_blk_copy_req_data(virtq, desc_head, (uintptr_t)&seg, false);
+
+    /* Reserved flags must be zero and we never unmap on discard */
+    if ((seg.flags & ~VIRTIO_BLK_DISCARD_F_UNMAP) || (!zeroes && (seg.flags & VIRTIO_BLK_DISCARD_F_UNMAP))) {
+        LOG_BLOCK_ERR("Unsupported discard or write zeroes flags 0x%x\n", seg.flags);
+        return BLK_REQ_UNSUPPORTED;
+    }
+
+    if (seg.num_sectors == 0 || seg.num_sectors > MAX_DISCARD_SECTORS || seg.sector >= state->config.capacity
+        || seg.num_sectors > state->config.capacity - seg.sector) {
+        LOG_BLOCK_ERR("Invalid discard or write zeroes of %d sectors at sector %d\n", seg.num_sectors, seg.sector);
+        return BLK_REQ_FAILED;
+    }
+
+    uint64_t start = seg.sector * VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t end = start + (uint64_t)seg.num_sectors * VIRTIO_BLK_SECTOR_SIZE;
+    uint64_t aligned_start = (start + BLK_TRANSFER_SIZE - 1) / BLK_TRANSFER_SIZE * BLK_TRANSFER_SIZE;
+    uint64_t aligned_end = end / BLK_TRANSFER_SIZE * BLK_TRANSFER_SIZE;
+
+    LOG_BLOCK("%s of %d sectors at sector %d\n", zeroes ? "Write zeroes" : "Discard", seg.num_sectors, seg.sector);
+
+    if (aligned_start >= aligned_end) {
+        /* No whole blocks */
+        if (zeroes && !virtio_blk_cache_zero(state, vq_idx, start, end)) {
+            return BLK_REQ_DEFERRED;
+        }
+        return BLK_REQ_COMPLETED;
+    }
+
+    if (!sddf_make_req_check(state, queue_h, 0)) {
+        return BLK_REQ_DEFERRED;
+    }
+    if (zeroes && (!virtio_blk_cache_zero(state, vq_idx, start, aligned_start)
+                   || !virtio_blk_cache_zero(state, vq_idx, aligned_end, end))) {
+        return BLK_REQ_DEFERRED;
+    }
+
+    uint32_t sddf_block_number = aligned_start / BLK_TRANSFER_SIZE;
+    uint16_t sddf_count = (aligned_end - aligned_start) / BLK_TRANSFER_SIZE;
+    if (zeroes) {
+        cache_write_through(state, sddf_block_number, sddf_count, 0);
+    }
+    cache_inflight_update(state, sddf_block_number, sddf_count, true);
+
+    uint32_t req_id;
+    ialloc_alloc(&state->ialloc, &req_id);
+    state->reqbk[req_id] = (reqbk_t) {
+        desc_head, 0, sddf_count, sddf_block_number, 0, 0, true
+    };
+    state->reqbk[req_id].generation = state->generation;
+
+    int err = blk_enqueue_req(queue_h, zeroes ? BLK_REQ_WRITE_ZEROES : BLK_REQ_DISCARD, 0,
+                              sddf_block_number, sddf_count, req_id);
+    assert(!err);
+
+    return BLK_REQ_ENQUEUED;
+}
+
+static blk_req_result_t virtio_blk_handle_req(struct virtio_device *dev, int vq_idx, uint16_t desc_head)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    struct virtq *virtq = &dev->vqs[vq_idx].virtq;
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+
+    /* Print out what the request type is */
+    struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[desc_head].addr;
+    LOG_BLOCK("----- Request type is 0x%x -----\n", virtio_req->type);
+
+    /* Parse different requests */
+    switch (virtio_req->type) {
+    /* There are three parts with each block request. The header, body (which contains the data) and reply. */
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        return virtio_blk_data_req(dev, vq_idx, desc_head, virtio_req);
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        if (!VIRTIO_BLK_DISCARD_FEATURES) {
+            /* Not offered, the driver should not have sent it */
+            return BLK_REQ_UNSUPPORTED;
+        }
+        return virtio_blk_discard_req(dev, vq_idx, desc_head, virtio_req);
+    case VIRTIO_BLK_T_FLUSH: {
+        LOG_BLOCK("Request type is VIRTIO_BLK_T_FLUSH\n");
+
+        /* Everything written to the cache before the flush has to be written
+         * back first, the flush stays parked until it has been */
+        virtio_blk_pending_t *pending = &state->pending[vq_idx];
+        if (pending->flush_seq == 0) {
+            pending->flush_seq = state->cache.seq;
+        }
+
+        bool failed = false;
+        bool flushed = cache_flushed(state, vq_idx, pending->flush_seq, &failed);
+        if (failed) {
+            LOG_BLOCK_ERR("Failed to write back cached blocks for flush\n");
+            pending->flush_seq = 0;
+            return BLK_REQ_FAILED;
+        }
+
+        if (!flushed || !sddf_make_req_check(state, queue_h, 0)) {
+            return BLK_REQ_DEFERRED;
+        }
+        pending->flush_seq = 0;
+
+        /* Book keep the request */
+        uint32_t req_id;
+        ialloc_alloc(&state->ialloc, &req_id);
+        /* except for virtio desc, nothing else needs to be retrieved later
+         * so leave as 0 */
+        state->reqbk[req_id] = (reqbk_t) {
+            desc_head, 0, 0, 0, 0, 0
+        };
+        state->reqbk[req_id].generation = state->generation;
+
+        int err = blk_enqueue_req(queue_h, FLUSH, 0, 0, 0, req_id);
+        assert(!err);
+        return BLK_REQ_ENQUEUED;
+    }
+    default:
+        LOG_BLOCK_ERR(
+            "Handling VirtIO block request, but virtIO request type is not recognised: %d\n",
+            virtio_req->type);
+        return BLK_REQ_FAILED;
+    }
+}
+
+/*
+ * Enqueues the writes of read-modify-write requests that could not be enqueued
+ * when their read completed. Returns false if some are still waiting.
+ */
+static bool virtio_blk_enqueue_rmw_writes(struct virtio_blk_device *state, int vq_idx, bool *enqueued)
+{
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+    virtio_blk_pending_t *pending = &state->pending[vq_idx];
+
+    while (pending->rmw_first != REQBK_NONE) {
+        if (blk_req_queue_full(queue_h)) {
+            return false;
+        }
+
+        uint32_t req_id = pending->rmw_first;
+        reqbk_t *data = &state->reqbk[req_id];
+        pending->rmw_first = data->next;
+
+        int err = blk_enqueue_req(queue_h,
+                                  WRITE_BLOCKS,
+                                  data->sddf_data - state->data_region,
+                                  data->sddf_block_number,
+                                  data->sddf_count,
+                                  req_id);
+        assert(!err);
+        *enqueued = true;
+    }
+
+    return true;
+}
+
+/*
+ * Releases the read-modify-write writes that are still waiting to be enqueued,
+ * their descriptor heads belong to a virtq that no longer exists.
+ */
+static void virtio_blk_drop_rmw_writes(struct virtio_blk_device *state, int vq_idx)
+{
+    virtio_blk_pending_t *pending = &state->pending[vq_idx];
+
+    while (pending->rmw_first != REQBK_NONE) {
+        uint32_t req_id = pending->rmw_first;
+        reqbk_t *data = &state->reqbk[req_id];
+        pending->rmw_first = data->next;
+
+        buddy_free(&state->data_alloc, data->sddf_data, data->sddf_count);
+        cache_inflight_update(state, data->sddf_block_number, data->sddf_count, false);
+        ialloc_free(&state->ialloc, req_id);
+    }
+    pending->rmw_last = REQBK_NONE;
+}
+
+static void virtio_blk_mmio_reset(struct virtio_device *dev)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    /* Requests still with the server are dropped when their responses arrive */
+    state->generation++;
+    for (int i = 0; i < dev->num_vqs; i++) {
+        dev->vqs[i].ready = false;
+        dev->vqs[i].last_idx = 0;
+        /* Parked work refers to the old virtq, forget about it */
+        state->pending[i].has_head = false;
+        state->pending[i].flush_seq = 0;
+        virtio_blk_drop_rmw_writes(state, i);
+    }
+}
+
+/*
+ * Services requests from a virtq until it is empty or we run out of sDDF
+ * resources. In the latter case the request that could not be serviced is
+ * parked and no further requests are taken from the virtq, so that requests
+ * are still issued in order. The virtq is resumed from virtio_blk_handle_resp
+ * once responses have freed up resources.
+ */
+static void virtio_blk_process_queue(struct virtio_device *dev, int vq_idx, bool *has_used, bool *enqueued)
+{
+    struct virtio_blk_device *state = device_state(dev);
+    virtio_queue_handler_t *vq = &dev->vqs[vq_idx];
+    virtio_blk_pending_t *pending = &state->pending[vq_idx];
+
+    if (!virtio_blk_enqueue_rmw_writes(state, vq_idx, enqueued)) {
+        return;
+    }
+
+    do {
+        uint16_t desc_head;
+        while (pending->has_head || virtio_mmio_vq_pop(vq, &desc_head)) {
+            if (pending->has_head) {
+                desc_head = pending->head;
+            }
+
+            blk_req_result_t result = virtio_blk_handle_req(dev, vq_idx, desc_head);
+            if (result == BLK_REQ_DEFERRED) {
+                LOG_BLOCK("Deferring request at descriptor %d until resources are available\n", desc_head);
+                pending->has_head = true;
+                pending->head = desc_head;
+                return;
+            }
+            pending->has_head = false;
+
+            if (result == BLK_REQ_FAILED) {
+                virtio_blk_set_req_fail(dev, vq_idx, desc_head);
+                virtio_blk_used_buffer(dev, vq_idx, desc_head);
+                *has_used = true;
+            } else if (result == BLK_REQ_UNSUPPORTED) {
+                virtio_blk_set_req_unsupp(dev, vq_idx, desc_head);
+                virtio_blk_used_buffer(dev, vq_idx, desc_head);
+                *has_used = true;
+            } else if (result == BLK_REQ_COMPLETED) {
+                virtio_blk_set_req_success(dev, vq_idx, desc_head);
+                virtio_blk_used_buffer(dev, vq_idx, desc_head);
+                *has_used = true;
+            } else {
+                *enqueued = true;
+            }
+        }
+    } while (virtio_mmio_vq_publish_avail_event(dev, vq));
+}
+
+static int virtio_blk_mmio_queue_notify(struct virtio_device *dev)
+{
+    /* Without VIRTIO_BLK_F_MQ the driver only ever notifies the default queue */
+    int vq_idx = dev->data.QueueNotify;
+    if (vq_idx >= dev->num_vqs || !dev->vqs[vq_idx].ready) {
+        LOG_BLOCK_ERR("driver notified invalid queue 0x%x\n", vq_idx);
+        return 0;
+    }
+    virtio_queue_handler_t *vq = &dev->vqs[vq_idx];
+
+    struct virtio_blk_device *state = device_state(dev);
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
+
+    bool has_used = false; /* if any request is completed straight away, e.g. it had to be dropped, this becomes true */
+    bool enqueued = false;
+
+    LOG_BLOCK("------------- Driver notified device -------------\n");
+    virtio_blk_process_queue(dev, vq_idx, &has_used, &enqueued);
 
     int success = 1;
 
-    /* If any request has to be dropped due to any number of reasons, we inject an interrupt */
-    if (has_dropped) {
+    /* If any request was completed straight away, we inject an interrupt */
+    if (has_used && virtio_mmio_vq_should_notify(dev, vq)) {
         virtio_blk_set_interrupt_status(dev, true, false);
         success = virtio_blk_virq_inject(dev);
     }
 
-    if (!blk_req_queue_plugged(&state->queue_h)) {
-        /* there is a world where all requests to be handled during this batch
-         * are dropped and hence this notify to the other PD would be redundant */
+    if (enqueued && !blk_req_queue_plugged(queue_h)) {
         microkit_notify(state->server_ch);
     }
 
     return success;
 }
 
-bool virtio_blk_handle_resp(struct virtio_blk_device *state)
+/* Processes all responses from the sDDF queue servicing the given virtq, returns true if any were handled */
+static bool virtio_blk_handle_queue_resp(struct virtio_blk_device *state, int vq_idx)
 {
     struct virtio_device *dev = &state->virtio_device;
+    blk_queue_handle_t *queue_h = &state->queue_h[vq_idx];
 
     blk_response_status_t sddf_ret_status;
     uint16_t sddf_ret_success_count;
@@ -389,8 +1054,8 @@ bool virtio_blk_handle_resp(struct virtio_blk_device *state)
 
     bool handled = false;
     int err = 0;
-    while (!blk_resp_queue_empty(&state->queue_h)) {
-        err = blk_dequeue_resp(&state->queue_h,
+    while (!blk_resp_queue_empty(queue_h)) {
+        err = blk_dequeue_resp(queue_h,
                                &sddf_ret_status,
                                &sddf_ret_success_count,
                                &sddf_ret_id);
@@ -400,37 +1065,71 @@ bool virtio_blk_handle_resp(struct virtio_blk_device *state)
         reqbk_t *data = &state->reqbk[sddf_ret_id];
         ialloc_free(&state->ialloc, sddf_ret_id);
 
-        struct virtq *virtq = &dev->vqs[VIRTIO_BLK_DEFAULT_VIRTQ].virtq;
+        if (data->cache_op != CACHE_OP_NONE) {
+            cache_handle_resp(state, data, sddf_ret_status == SUCCESS);
+            continue;
+        }
 
-        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[data->virtio_desc_head].addr;
+        if (data->generation != state->generation) {
+            /* Made before the device was reset, the descriptor head belongs to
+             * the old virtq so only give back what the request was holding */
+            LOG_BLOCK("Dropping response to request %d made before reset\n", sddf_ret_id);
+            if (!data->zero_copy && data->sddf_data != 0) {
+                buddy_free(&state->data_alloc, data->sddf_data, data->sddf_count);
+            }
+            cache_inflight_update(state, data->sddf_block_number, data->sddf_count, false);
+            continue;
+        }
+
+        struct virtq *virtq = &dev->vqs[vq_idx].virtq;
 
-        uint16_t curr_virtio_desc = virtq->desc[data->virtio_desc_head].next;
+        struct virtio_blk_outhdr *virtio_req = (void *)virtq->desc[data->virtio_desc_head].addr;
 
         bool resp_success = false;
         if (sddf_ret_status == SUCCESS) {
             resp_success = true;
             switch (virtio_req->type) {
             case VIRTIO_BLK_T_IN: {
-                memcpy((void *)virtq->desc[curr_virtio_desc].addr,
-                       (void *)data->virtio_data, data->virtio_data_size);
+                if (data->zero_copy) {
+                    cache_overlay(state, data->sddf_block_number, data->sddf_count, data->virtio_data);
+                } else {
+                    cache_overlay(state, data->sddf_block_number, data->sddf_count, data->sddf_data);
+                    /* Scatter the data buffer out into the virtio buffers */
+                    virtio_blk_copy_req_data(virtq, data->virtio_desc_head, data->virtio_data, true);
+                }
                 break;
             }
             case VIRTIO_BLK_T_OUT: {
                 if (!data->aligned) {
                     /* Copy the write data into an offset into the allocated sddf data buffer */
-                    memcpy((void *)data->virtio_data,
-                           (void *)virtq->desc[curr_virtio_desc].addr,
-                           data->virtio_data_size);
+                    cache_overlay(state, data->sddf_block_number, data->sddf_count, data->sddf_data);
+                    virtio_blk_copy_req_data(virtq, data->virtio_desc_head, data->virtio_data, false);
+                    cache_write_through(state, data->sddf_block_number, data->sddf_count, data->sddf_data);
 
+                    /* The id we just freed is always available for the write */
                     uint32_t new_sddf_id;
                     ialloc_alloc(&state->ialloc, &new_sddf_id);
                     state->reqbk[new_sddf_id] = (reqbk_t) {
                         data->virtio_desc_head,
                              data->sddf_data, data->sddf_count,
-                             data->sddf_block_number, 0, 0, true
+                             data->sddf_block_number, 0, 0, true, false, REQBK_NONE
                     };
-
-                    err = blk_enqueue_req(&state->queue_h,
+                    state->reqbk[new_sddf_id].generation = data->generation;
+
+                    virtio_blk_pending_t *pending = &state->pending[vq_idx];
+                    if (pending->rmw_first != REQBK_NONE || blk_req_queue_full(queue_h)) {
+                        /* Keep the writes in order behind any that are already waiting */
+                        LOG_BLOCK("Deferring write of read-modify-write request %d\n", new_sddf_id);
+                        if (pending->rmw_first == REQBK_NONE) {
+                            pending->rmw_first = new_sddf_id;
+                        } else {
+                            state->reqbk[pending->rmw_last].next = new_sddf_id;
+                        }
+                        pending->rmw_last = new_sddf_id;
+                        continue;
+                    }
+
+                    err = blk_enqueue_req(queue_h,
                                           WRITE_BLOCKS,
                                           data->sddf_data - state->data_region,
                                           data->sddf_block_number,
@@ -443,6 +1142,8 @@ bool virtio_blk_handle_resp(struct virtio_blk_device *state)
                 break;
             }
             case VIRTIO_BLK_T_FLUSH:
+            case VIRTIO_BLK_T_DISCARD:
+            case VIRTIO_BLK_T_WRITE_ZEROES:
                 break;
             default: {
                 LOG_BLOCK_ERR(
@@ -455,27 +1156,61 @@ bool virtio_blk_handle_resp(struct virtio_blk_device *state)
         }
 
         if (resp_success) {
-            virtio_blk_set_req_success(dev, data->virtio_desc_head);
+            virtio_blk_set_req_success(dev, vq_idx, data->virtio_desc_head);
         } else {
-            virtio_blk_set_req_fail(dev, data->virtio_desc_head);
+            virtio_blk_set_req_fail(dev, vq_idx, data->virtio_desc_head);
         }
 
         /* Free corresponding bookkeeping structures regardless of the request's
          * success status */
         if (virtio_req->type == VIRTIO_BLK_T_IN || virtio_req->type == VIRTIO_BLK_T_OUT) {
-            fsmalloc_free(&state->fsmalloc, data->sddf_data, data->sddf_count);
+            if (!data->zero_copy) {
+                buddy_free(&state->data_alloc, data->sddf_data, data->sddf_count);
+            }
+            cache_inflight_update(state, data->sddf_block_number, data->sddf_count, false);
+        } else if (virtio_req->type == VIRTIO_BLK_T_DISCARD || virtio_req->type == VIRTIO_BLK_T_WRITE_ZEROES) {
+            cache_inflight_update(state, data->sddf_block_number, data->sddf_count, false);
         }
 
-        virtio_blk_used_buffer(dev, data->virtio_desc_head);
+        virtio_blk_used_buffer(dev, vq_idx, data->virtio_desc_head);
 
         handled = true;
     }
 
-    bool success = true;
+    return handled;
+}
+
+bool virtio_blk_handle_resp(struct virtio_blk_device *state)
+{
+    struct virtio_device *dev = &state->virtio_device;
 
     /* We need to know if we handled any responses, if we did we inject an
-     * interrupt, if we didn't we don't inject */
-    if (handled) {
+     * interrupt unless the driver has asked us not to */
+    bool handled[VIRTIO_BLK_MAX_NUM_VIRTQ];
+    for (int i = 0; i < dev->num_vqs; i++) {
+        handled[i] = virtio_blk_handle_queue_resp(state, i);
+    }
+
+    bool notify = false;
+    for (int i = 0; i < dev->num_vqs; i++) {
+        /* Responses free up sDDF resources and complete cache writebacks, which
+         * are shared between queues, resume any work that was waiting on them */
+        virtio_blk_pending_t *pending = &state->pending[i];
+        if (pending->has_head || pending->rmw_first != REQBK_NONE) {
+            bool enqueued = false;
+            virtio_blk_process_queue(dev, i, &handled[i], &enqueued);
+            if (enqueued && !blk_req_queue_plugged(&state->queue_h[i])) {
+                microkit_notify(state->server_ch);
+            }
+        }
+
+        if (handled[i] && virtio_mmio_vq_should_notify(dev, &dev->vqs[i])) {
+            notify = true;
+        }
+    }
+
+    bool success = true;
+    if (notify) {
         virtio_blk_set_interrupt_status(dev, true, false);
         success = virtio_blk_virq_inject(dev);
     }
@@ -487,7 +1222,28 @@ static void virtio_blk_config_init(struct virtio_blk_device *blk_dev)
 {
     blk_storage_info_t *storage_info = blk_dev->storage_info;
 
+    /* Every request needs a descriptor for the header and one for the status on
+     * top of its data descriptors, and must fit in the virtq at once as we do not
+     * support indirect descriptors. */
+    blk_dev->config.seg_max = QUEUE_SIZE - 2;
+    /* Requests are bounced through the data region so the largest request we
+     * can ever service is the largest buffer we can allocate from it, less a
+     * block on either side for requests that are not aligned to BLK_TRANSFER_SIZE. */
+    uint32_t max_req_size = (blk_dev->sddf_data_buffers - 2) * BLK_TRANSFER_SIZE;
+    blk_dev->config.size_max = (max_req_size / blk_dev->config.seg_max) & ~(VIRTIO_BLK_SECTOR_SIZE - 1);
+    if (blk_dev->config.size_max < VIRTIO_BLK_SECTOR_SIZE) {
+        blk_dev->config.size_max = VIRTIO_BLK_SECTOR_SIZE;
+    }
+
     blk_dev->config.capacity = (BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE) * storage_info->capacity;
+    blk_dev->config.num_queues = blk_dev->virtio_device.num_vqs;
+
+    blk_dev->config.max_discard_sectors = MAX_DISCARD_SECTORS;
+    blk_dev->config.max_discard_seg = 1;
+    blk_dev->config.discard_sector_alignment = BLK_TRANSFER_SIZE / VIRTIO_BLK_SECTOR_SIZE;
+    blk_dev->config.max_write_zeroes_sectors = MAX_DISCARD_SECTORS;
+    blk_dev->config.max_write_zeroes_seg = 1;
+    blk_dev->config.write_zeroes_may_unmap = 0;
     if (storage_info->block_size != 0) {
         blk_dev->config.blk_size = storage_info->block_size * BLK_TRANSFER_SIZE;
     } else {
@@ -504,6 +1260,19 @@ static virtio_device_funs_t functions = {
     .queue_notify = virtio_blk_mmio_queue_notify,
 };
 
+void virtio_blk_zero_copy_init(struct virtio_blk_device *blk_dev,
+                               uintptr_t guest_base,
+                               size_t size,
+                               uint64_t sddf_offset)
+{
+    assert(guest_base % BLK_TRANSFER_SIZE == 0);
+    assert(sddf_offset % BLK_TRANSFER_SIZE == 0);
+
+    blk_dev->zero_copy = (virtio_blk_zero_copy_t) {
+        guest_base, size, sddf_offset
+    };
+}
+
 bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
                           uintptr_t region_base,
                           uintptr_t region_size,
@@ -512,6 +1281,7 @@ bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
                           size_t data_region_size,
                           blk_storage_info_t *storage_info,
                           blk_queue_handle_t *queue_h,
+                          size_t num_queues,
                           int server_ch)
 {
     struct virtio_device *dev = &blk_dev->virtio_device;
@@ -520,12 +1290,19 @@ bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
     dev->data.VendorID = VIRTIO_MMIO_DEV_VENDOR_ID;
     dev->funs = &functions;
     dev->vqs = blk_dev->vqs;
-    dev->num_vqs = VIRTIO_BLK_NUM_VIRTQ;
     dev->virq = virq;
     dev->device_data = blk_dev;
 
+    assert(num_queues > 0 && num_queues <= VIRTIO_BLK_MAX_NUM_VIRTQ);
+    dev->num_vqs = num_queues;
+    for (int i = 0; i < num_queues; i++) {
+        blk_dev->queue_h[i] = queue_h[i];
+        blk_dev->pending[i] = (virtio_blk_pending_t) {
+            false, 0, REQBK_NONE, REQBK_NONE, 0
+        };
+    }
+
     blk_dev->storage_info = storage_info;
-    blk_dev->queue_h = *queue_h;
     blk_dev->data_region = data_region;
     blk_dev->server_ch = server_ch;
 
@@ -534,16 +1311,33 @@ bool virtio_mmio_blk_init(struct virtio_blk_device *blk_dev,
      * defined size at compile time and that depends on the number of buffers
      * passed to us during initialisation. */
     assert(sddf_data_buffers <= SDDF_MAX_DATA_BUFFERS);
+    assert(sddf_data_buffers > VIRTIO_BLK_CACHE_ENTRIES + 2);
+
+    /* The write cache takes the buffers at the end of the data region */
+    uint32_t request_buffers = sddf_data_buffers - VIRTIO_BLK_CACHE_ENTRIES;
+    blk_dev->cache.seq = 1;
+    for (int i = 0; i < VIRTIO_BLK_CACHE_ENTRIES; i++) {
+        blk_dev->cache.entries[i] = (virtio_blk_cache_entry_t) {
+            .buf = data_region + (request_buffers + i) * BLK_TRANSFER_SIZE
+        };
+    }
+
+    /* The allocator hands out naturally aligned power-of-two blocks, so that
+     * is the largest request it can ever satisfy */
+    blk_dev->sddf_data_buffers = 1u << (31 - __builtin_clz(request_buffers));
+    /* Zero-copy is opt-in, see virtio_blk_zero_copy_init */
+    blk_dev->zero_copy.size = 0;
+    blk_dev->generation = 0;
 
     virtio_blk_config_init(blk_dev);
 
-    fsmalloc_init(&blk_dev->fsmalloc,
-                  data_region,
-                  BLK_TRANSFER_SIZE,
-                  sddf_data_buffers,
-                  &blk_dev->fsmalloc_avail_bitarr,
-                  blk_dev->fsmalloc_avail_bitarr_words,
-                  roundup_bits2words64(sddf_data_buffers));
+    buddy_init(&blk_dev->data_alloc,
+               data_region,
+               BLK_TRANSFER_SIZE,
+               request_buffers,
+               blk_dev->data_alloc_next,
+               blk_dev->data_alloc_prev,
+               blk_dev->data_alloc_order);
 
     ialloc_init(&blk_dev->ialloc, blk_dev->ialloc_idxlist, sddf_data_buffers);
 
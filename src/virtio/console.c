@@ -117,50 +117,59 @@ static int virtio_console_handle_tx(struct virtio_device *dev)
     struct virtio_console_device *console = device_state(dev);
 
     /* Transmit all available descriptors possible */
-    LOG_CONSOLE("processing available buffers from index [0x%lx..0x%lx)\n", vq->last_idx, vq->virtq.avail->idx);
+    LOG_CONSOLE("processing available buffers from index 0x%lx\n", vq->last_idx);
     bool transferred = false;
-    while (vq->last_idx != vq->virtq.avail->idx && !serial_queue_full(&console->txq, console->txq.queue->head))
-    {
-        uint16_t desc_idx = vq->virtq.avail->ring[vq->last_idx % vq->virtq.num];
-        struct virtq_desc desc;
-        /* Traverse chained descriptors */
-        do {
-            desc = vq->virtq.desc[desc_idx];
-            // @ivanv: to the debug logging, we should actually print out the buffer contents
-            LOG_CONSOLE("processing descriptor (0x%lx) with buffer [0x%lx..0x%lx)\n", desc_idx, desc.addr, desc.addr + desc.len);
-
-            uint32_t bytes_remain = desc.len;
-            /* Copy all contiguous data */
-            while (bytes_remain > 0 && !serial_queue_full(&console->txq, console->txq.queue->head))
-            {
-                uint32_t free = serial_queue_contiguous_free(&console->txq);
-                uint32_t to_transfer = (bytes_remain < free) ? bytes_remain : free;
-                if (to_transfer) transferred = true;
-
-                memcpy(console->txq.data_region + (console->txq.queue->tail % console->txq.size),
-                        (char *) (desc.addr + (desc.len - bytes_remain)), to_transfer);
-
-                serial_update_visible_tail(&console->txq, console->txq.queue->tail + to_transfer);
-                bytes_remain -= to_transfer;
-            }
-
-            desc_idx = desc.next;
-
-        } while (desc.flags & VIRTQ_DESC_F_NEXT && !serial_queue_full(&console->txq, console->txq.queue->head));
-
-        struct virtq_used_elem used_elem = {vq->virtq.avail->ring[vq->last_idx % vq->virtq.num], 0};
-        vq->virtq.used->ring[vq->virtq.used->idx % vq->virtq.num] = used_elem;
-        vq->virtq.used->idx++;
+    uint16_t desc_head;
+    do {
+        while (!serial_queue_full(&console->txq, console->txq.queue->head) && virtio_mmio_vq_pop(vq, &desc_head))
+        {
+            uint16_t desc_idx = desc_head;
+            struct virtq_desc desc;
+            /* Traverse chained descriptors */
+            do {
+                desc = vq->virtq.desc[desc_idx];
+                // @ivanv: to the debug logging, we should actually print out the buffer contents
+                LOG_CONSOLE("processing descriptor (0x%lx) with buffer [0x%lx..0x%lx)\n", desc_idx, desc.addr, desc.addr + desc.len);
+
+                uint32_t bytes_remain = desc.len;
+                /* Copy all contiguous data */
+                while (bytes_remain > 0 && !serial_queue_full(&console->txq, console->txq.queue->head))
+                {
+                    uint32_t free = serial_queue_contiguous_free(&console->txq);
+                    uint32_t to_transfer = (bytes_remain < free) ? bytes_remain : free;
+                    if (to_transfer) transferred = true;
+
+                    memcpy(console->txq.data_region + (console->txq.queue->tail % console->txq.size),
+                            (char *) (desc.addr + (desc.len - bytes_remain)), to_transfer);
+
+                    serial_update_visible_tail(&console->txq, console->txq.queue->tail + to_transfer);
+                    bytes_remain -= to_transfer;
+                }
+
+                desc_idx = desc.next;
+
+            } while (desc.flags & VIRTQ_DESC_F_NEXT && !serial_queue_full(&console->txq, console->txq.queue->head));
+
+            virtio_mmio_vq_push(vq, desc_head, 0);
+        }
+    } while (!serial_queue_full(&console->txq, console->txq.queue->head) && virtio_mmio_vq_publish_avail_event(dev, vq));
 
-        vq->last_idx++;
+    /* If we ran out of space in the serial queue we might not have consumed
+     * everything the driver made available. Make sure it kicks us again when
+     * it adds the next buffer so that we can retry. */
+    if (serial_queue_full(&console->txq, console->txq.queue->head)) {
+        virtio_mmio_vq_request_kick(dev, vq);
     }
 
     /* While unlikely, it is possible that we could not consume any of the
      * available data. In this case we do not set the IRQ status. */
     if (transferred) {
-        dev->data.InterruptStatus = BIT_LOW(0);
-        bool success = virq_inject(GUEST_VCPU_ID, dev->virq);
-        assert(success);
+        bool success = true;
+        if (virtio_mmio_vq_should_notify(dev, vq)) {
+            dev->data.InterruptStatus = BIT_LOW(0);
+            success = virq_inject(GUEST_VCPU_ID, dev->virq);
+            assert(success);
+        }
 
         if (serial_require_producer_signal(&console->txq)) {
             serial_cancel_producer_signal(&console->txq);
@@ -184,11 +193,11 @@ int virtio_console_handle_rx(struct virtio_console_device *console)
     bool reprocess = true;
     while (reprocess) {
         struct virtio_queue_handler *vq = &console->virtio_device.vqs[RX_QUEUE];
-        LOG_CONSOLE("processing available buffers from index [0x%lx..0x%lx)\n", vq->last_idx, vq->virtq.avail->idx);
-        while (vq->last_idx != vq->virtq.avail->idx && !serial_queue_empty(&console->rxq, console->rxq.queue->head)) {
+        LOG_CONSOLE("processing available buffers from index 0x%lx\n", vq->last_idx);
+        uint16_t desc_head;
+        while (!serial_queue_empty(&console->rxq, console->rxq.queue->head) && virtio_mmio_vq_pop(vq, &desc_head)) {
             transferred = true;
 
-            uint16_t desc_head = vq->virtq.avail->ring[vq->last_idx % vq->virtq.num];
             struct virtq_desc desc = vq->virtq.desc[desc_head];
             LOG_CONSOLE("processing descriptor (0x%lx) with buffer [0x%lx..0x%lx)\n", desc_head, desc.addr, desc.addr + desc.len);
             uint32_t bytes_written = 0;
@@ -198,17 +207,13 @@ int virtio_console_handle_rx(struct virtio_console_device *console)
                 bytes_written++;
             }
 
-            struct virtq_used_elem used_elem = {desc_head, bytes_written};
-            vq->virtq.used->ring[vq->virtq.used->idx % vq->virtq.num] = used_elem;
-            vq->virtq.used->idx++;
-
-            vq->last_idx++;
+            virtio_mmio_vq_push(vq, desc_head, bytes_written);
         }
 
         serial_request_producer_signal(&console->rxq);
         reprocess = false;
 
-        if (vq->last_idx != vq->virtq.avail->idx && !serial_queue_empty(&console->rxq, console->rxq.queue->head)) {
+        if (virtio_mmio_vq_has_avail(vq) && !serial_queue_empty(&console->rxq, console->rxq.queue->head)) {
             serial_cancel_producer_signal(&console->rxq);
             reprocess = true;
         }
@@ -216,7 +221,7 @@ int virtio_console_handle_rx(struct virtio_console_device *console)
 
     /* While unlikely, it is possible that we could not consume any of the
      * available data. In this case we do not set the IRQ status. */
-    if (transferred) {
+    if (transferred && virtio_mmio_vq_should_notify(&console->virtio_device, &console->virtio_device.vqs[RX_QUEUE])) {
         console->virtio_device.data.InterruptStatus = BIT_LOW(0);
         bool success = virq_inject(GUEST_VCPU_ID, console->virtio_device.virq);
         assert(success);
@@ -26,6 +26,293 @@
 
 #define REG_RANGE(r0, r1)   r0 ... (r1 - 1)
 
+/* Uncomment this to stop offering packed virtqueues to the guest, for example
+ * to compare the performance of split and packed virtqueues. */
+// #define VIRTIO_MMIO_NO_RING_PACKED
+
+#if defined(VIRTIO_MMIO_NO_RING_PACKED)
+#define TRANSPORT_F_RING_PACKED 0
+#else
+#define TRANSPORT_F_RING_PACKED (1ull << VIRTIO_F_RING_PACKED)
+#endif
+
+/*
+ * Feature bits that are implemented by this layer for every device rather
+ * than by the device itself. They are advertised in addition to whatever the
+ * device offers and are stripped before the driver's selection is passed
+ * to the device.
+ */
+#define VIRTIO_MMIO_TRANSPORT_FEATURES ((1ull << VIRTIO_RING_F_EVENT_IDX) | TRANSPORT_F_RING_PACKED)
+
+#define PACKED_DESC_F_AVAIL (1 << VIRTQ_PACKED_DESC_F_AVAIL)
+#define PACKED_DESC_F_USED  (1 << VIRTQ_PACKED_DESC_F_USED)
+
+static uint32_t transport_features_word(uint32_t sel)
+{
+    if (sel > 1) {
+        return 0;
+    }
+    return (uint32_t)(VIRTIO_MMIO_TRANSPORT_FEATURES >> (sel * 32));
+}
+
+static inline bool event_idx_enabled(virtio_device_t *dev)
+{
+    return dev->data.transport_features & (1ull << VIRTIO_RING_F_EVENT_IDX);
+}
+
+static inline bool packed_desc_is_avail(uint16_t flags, bool wrap)
+{
+    bool avail = flags & PACKED_DESC_F_AVAIL;
+    bool used = flags & PACKED_DESC_F_USED;
+    return avail == wrap && used != wrap;
+}
+
+/*
+ * Called when the driver sets QueueReady. For packed virtqs the addresses the
+ * driver gave us for the descriptor, driver and device areas are moved into
+ * the packed state and virtq.desc is pointed at the shadow descriptors.
+ */
+static void virtio_mmio_vq_init(virtio_device_t *dev, virtio_queue_handler_t *vq)
+{
+    vq->packed = dev->data.transport_features & (1ull << VIRTIO_F_RING_PACKED);
+    if (!vq->packed) {
+        return;
+    }
+
+    virtio_packed_queue_t *packed = &vq->packed_state;
+    packed->desc = (struct virtq_packed_desc *)vq->virtq.desc;
+    packed->driver = (struct virtq_packed_event *)vq->virtq.avail;
+    packed->device = (struct virtq_packed_event *)vq->virtq.used;
+    packed->avail_wrap = true;
+    packed->used_idx = 0;
+    packed->used_wrap = true;
+    packed->used_since_signal = 0;
+    for (uint16_t i = 0; i < QUEUE_SIZE; i++) {
+        packed->shadow[i].next = i + 1;
+    }
+    packed->shadow_free = 0;
+
+    vq->virtq.desc = packed->shadow;
+    vq->virtq.avail = NULL;
+    vq->virtq.used = NULL;
+}
+
+bool virtio_mmio_vq_should_notify(virtio_device_t *dev, virtio_queue_handler_t *vq)
+{
+    struct virtq *virtq = &vq->virtq;
+
+    /* The used ring must be visible to the guest before we look at whether it
+     * wants to be interrupted, otherwise we can race with the driver re-enabling
+     * interrupts and miss a notification. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (vq->packed) {
+        virtio_packed_queue_t *packed = &vq->packed_state;
+        uint16_t flags = packed->driver->flags;
+        uint16_t off_wrap = packed->driver->off_wrap;
+
+        /* Like the event offset below, the old index may be in the previous wrap,
+         * so work it out from the distance moved rather than the index we last
+         * signalled at, which has lost the wrap */
+        uint16_t new = packed->used_idx;
+        int old = new - packed->used_since_signal;
+        bool wrapped = packed->used_since_signal >= virtq->num;
+        vq->signalled_used = new;
+        packed->used_since_signal = 0;
+
+        if (flags == VIRTQ_PACKED_EVENT_FLAG_DISABLE) {
+            return false;
+        }
+        if (flags != VIRTQ_PACKED_EVENT_FLAG_DESC || !event_idx_enabled(dev) || wrapped) {
+            return true;
+        }
+
+        /* Convert the event offset to be relative to the same wrap as the
+         * used index so that virtq_need_event works across the wrap. */
+        int off = off_wrap & ~(1 << VIRTQ_PACKED_EVENT_F_WRAP_CTR);
+        if (packed->used_wrap != (off_wrap >> VIRTQ_PACKED_EVENT_F_WRAP_CTR)) {
+            off -= virtq->num;
+        }
+        return virtq_need_event(off, new, old);
+    }
+
+    if (!event_idx_enabled(dev)) {
+        return !(virtq->avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT);
+    }
+
+    uint16_t old = vq->signalled_used;
+    uint16_t new = virtq->used->idx;
+    vq->signalled_used = new;
+
+    return virtq_need_event(virtq_used_event(virtq), new, old);
+}
+
+bool virtio_mmio_vq_publish_avail_event(virtio_device_t *dev, virtio_queue_handler_t *vq)
+{
+    struct virtq *virtq = &vq->virtq;
+
+    if (!event_idx_enabled(dev)) {
+        return false;
+    }
+
+    if (vq->packed) {
+        virtio_packed_queue_t *packed = &vq->packed_state;
+        packed->device->off_wrap = vq->last_idx | (packed->avail_wrap << VIRTQ_PACKED_EVENT_F_WRAP_CTR);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        packed->device->flags = VIRTQ_PACKED_EVENT_FLAG_DESC;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        return virtio_mmio_vq_has_avail(vq);
+    }
+
+    virtq_avail_event(virtq) = vq->last_idx;
+    /* Make sure the driver can see avail_event before we check whether it
+     * added more buffers, see the comment in virtio_mmio_vq_should_notify. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return virtio_mmio_vq_has_avail(vq);
+}
+
+void virtio_mmio_vq_request_kick(virtio_device_t *dev, virtio_queue_handler_t *vq)
+{
+    if (!event_idx_enabled(dev)) {
+        /* We never suppress kicks without VIRTIO_RING_F_EVENT_IDX */
+        return;
+    }
+
+    if (vq->packed) {
+        vq->packed_state.device->flags = VIRTQ_PACKED_EVENT_FLAG_ENABLE;
+    } else {
+        virtq_avail_event(&vq->virtq) = vq->virtq.avail->idx;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+bool virtio_mmio_vq_has_avail(virtio_queue_handler_t *vq)
+{
+    if (vq->packed) {
+        return packed_desc_is_avail(vq->packed_state.desc[vq->last_idx].flags, vq->packed_state.avail_wrap);
+    }
+
+    return vq->last_idx != vq->virtq.avail->idx;
+}
+
+static bool virtio_mmio_vq_pop_packed(virtio_queue_handler_t *vq, uint16_t *head)
+{
+    virtio_packed_queue_t *packed = &vq->packed_state;
+    uint16_t num = vq->virtq.num;
+
+    if (!virtio_mmio_vq_has_avail(vq)) {
+        return false;
+    }
+    /* Do not read the rest of the chain before we know the head is available */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    uint16_t first = QUEUE_SIZE;
+    uint16_t prev = QUEUE_SIZE;
+    uint16_t count = 0;
+    struct virtq_packed_desc *desc;
+    do {
+        desc = &packed->desc[vq->last_idx];
+
+        uint16_t slot = packed->shadow_free;
+        /* The driver cannot have more descriptors in flight than there are in the ring */
+        assert(slot < QUEUE_SIZE);
+        packed->shadow_free = packed->shadow[slot].next;
+        packed->shadow[slot] = (struct virtq_desc) {
+            .addr = desc->addr,
+            .len = desc->len,
+            .flags = desc->flags & (VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_INDIRECT),
+            .next = 0,
+        };
+        if (prev == QUEUE_SIZE) {
+            first = slot;
+        } else {
+            packed->shadow[prev].next = slot;
+        }
+        prev = slot;
+        count++;
+
+        vq->last_idx++;
+        if (vq->last_idx >= num) {
+            vq->last_idx -= num;
+            packed->avail_wrap = !packed->avail_wrap;
+        }
+    } while ((desc->flags & VIRTQ_DESC_F_NEXT) && count < num);
+
+    /* The buffer ID is in the last descriptor of the chain */
+    packed->shadow_id[first] = desc->id;
+    packed->shadow_num[first] = count;
+    *head = first;
+
+    return true;
+}
+
+bool virtio_mmio_vq_pop(virtio_queue_handler_t *vq, uint16_t *head)
+{
+    if (vq->packed) {
+        return virtio_mmio_vq_pop_packed(vq, head);
+    }
+
+    struct virtq *virtq = &vq->virtq;
+    if (!virtio_mmio_vq_has_avail(vq)) {
+        return false;
+    }
+    /* Do not read the ring entry before we have seen the index */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    *head = virtq->avail->ring[vq->last_idx % virtq->num];
+    vq->last_idx++;
+
+    return true;
+}
+
+static void virtio_mmio_vq_push_packed(virtio_queue_handler_t *vq, uint16_t head, uint32_t len)
+{
+    virtio_packed_queue_t *packed = &vq->packed_state;
+    uint16_t num = vq->virtq.num;
+    uint16_t count = packed->shadow_num[head];
+
+    struct virtq_packed_desc *desc = &packed->desc[packed->used_idx];
+    desc->id = packed->shadow_id[head];
+    desc->len = len;
+    /* The driver must see the ID and length before it sees the descriptor as used */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    desc->flags = packed->used_wrap ? (PACKED_DESC_F_AVAIL | PACKED_DESC_F_USED) : 0;
+
+    /* A used descriptor stands in for the whole chain, skip over the rest */
+    packed->used_idx += count;
+    if (packed->used_idx >= num) {
+        packed->used_idx -= num;
+        packed->used_wrap = !packed->used_wrap;
+    }
+    packed->used_since_signal += count;
+
+    /* Give the shadow descriptors of the chain back to the free list */
+    uint16_t last = head;
+    for (uint16_t i = 1; i < count; i++) {
+        last = packed->shadow[last].next;
+    }
+    packed->shadow[last].next = packed->shadow_free;
+    packed->shadow_free = head;
+}
+
+void virtio_mmio_vq_push(virtio_queue_handler_t *vq, uint16_t head, uint32_t len)
+{
+    if (vq->packed) {
+        virtio_mmio_vq_push_packed(vq, head, len);
+        return;
+    }
+
+    struct virtq *virtq = &vq->virtq;
+    struct virtq_used_elem *used_elem = &virtq->used->ring[virtq->used->idx % virtq->num];
+    used_elem->id = head;
+    used_elem->len = len;
+    /* The driver must see the used element before the index update */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    virtq->used->idx++;
+}
+
 struct virtq *get_current_virtq_by_handler(virtio_device_t *dev)
 {
     assert(dev->data.QueueSel < dev->num_vqs);
@@ -55,6 +342,11 @@ int handle_virtio_mmio_set_status_flag(virtio_device_t *dev, uint32_t reg)
     switch (reg) {
     case VIRTIO_CONFIG_S_RESET:
         dev->data.Status = 0;
+        dev->data.transport_features = 0;
+        for (int i = 0; i < dev->num_vqs; i++) {
+            dev->vqs[i].signalled_used = 0;
+            dev->vqs[i].packed = false;
+        }
         dev->funs->device_reset(dev);
         break;
 
@@ -121,6 +413,7 @@ static bool handle_virtio_mmio_reg_read(virtio_device_t *dev, size_t vcpu_id, si
         break;
     case REG_RANGE(REG_VIRTIO_MMIO_DEVICE_FEATURES, REG_VIRTIO_MMIO_DEVICE_FEATURES_SEL):
         success = dev->funs->get_device_features(dev, &reg);
+        reg |= transport_features_word(dev->data.DeviceFeaturesSel);
         break;
     case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_NUM_MAX, REG_VIRTIO_MMIO_QUEUE_NUM):
         reg = QUEUE_SIZE;
@@ -180,9 +473,16 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
     case REG_RANGE(REG_VIRTIO_MMIO_DEVICE_FEATURES_SEL, REG_VIRTIO_MMIO_DRIVER_FEATURES):
         dev->data.DeviceFeaturesSel = data;
         break;
-    case REG_RANGE(REG_VIRTIO_MMIO_DRIVER_FEATURES, REG_VIRTIO_MMIO_DRIVER_FEATURES_SEL):
-        success = dev->funs->set_driver_features(dev, data);
+    case REG_RANGE(REG_VIRTIO_MMIO_DRIVER_FEATURES, REG_VIRTIO_MMIO_DRIVER_FEATURES_SEL): {
+        uint32_t transport = transport_features_word(dev->data.DriverFeaturesSel);
+        if (transport) {
+            uint32_t shift = dev->data.DriverFeaturesSel * 32;
+            dev->data.transport_features &= ~((uint64_t)transport << shift);
+            dev->data.transport_features |= (uint64_t)(data & transport) << shift;
+        }
+        success = dev->funs->set_driver_features(dev, data & ~transport);
         break;
+    }
     case REG_RANGE(REG_VIRTIO_MMIO_DRIVER_FEATURES_SEL, REG_VIRTIO_MMIO_QUEUE_SEL):
         dev->data.DriverFeaturesSel = data;
         break;
@@ -191,6 +491,11 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         break;
     case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_NUM, REG_VIRTIO_MMIO_QUEUE_READY): {
         if (dev->data.QueueSel < dev->num_vqs) {
+            if (data > QUEUE_SIZE) {
+                LOG_VMM_ERR("virtq size 0x%lx is larger than the maximum 0x%lx\n", data, QUEUE_SIZE);
+                success = false;
+                break;
+            }
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             virtq->num = (unsigned int)data;
         } else {
@@ -201,9 +506,14 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         break;
     }
     case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_READY, REG_VIRTIO_MMIO_QUEUE_NOTIFY):
-        if (data == 0x1) {
+        if (dev->data.QueueSel >= dev->num_vqs) {
+            LOG_VMM_ERR("invalid virtq index 0x%lx (number of virtqs is 0x%lx) "
+                        "given when accessing REG_VIRTIO_MMIO_QUEUE_READY\n", dev->data.QueueSel, dev->num_vqs);
+            success = false;
+        } else if (data == 0x1 && !dev->vqs[dev->data.QueueSel].ready) {
+            // the virtq is already in ram, we only need to set up our own state
+            virtio_mmio_vq_init(dev, &dev->vqs[dev->data.QueueSel]);
             dev->vqs[dev->data.QueueSel].ready = true;
-            // the virtq is already in ram so we don't need to do any initiation
         }
         break;
     case REG_RANGE(REG_VIRTIO_MMIO_QUEUE_NOTIFY, REG_VIRTIO_MMIO_INTERRUPT_STATUS):
@@ -220,7 +530,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->desc;
-            ptr |= data;
+            ptr = (ptr & ~0xffffffffull) | data;
             virtq->desc = (struct virtq_desc *)ptr;
         } else {
             LOG_VMM_ERR("invalid virtq index 0x%lx (number of virtqs is 0x%lx) "
@@ -233,7 +543,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->desc;
-            ptr |= (uintptr_t)data << 32;
+            ptr = (ptr & 0xffffffffull) | ((uintptr_t)data << 32);
             virtq->desc = (struct virtq_desc *)ptr;
         } else {
             LOG_VMM_ERR("invalid virtq index 0x%lx (number of virtqs is 0x%lx) "
@@ -246,7 +556,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->avail;
-            ptr |= data;
+            ptr = (ptr & ~0xffffffffull) | data;
             virtq->avail = (struct virtq_avail *)ptr;
         } else {
             LOG_VMM_ERR("invalid virtq index 0x%lx (number of virtqs is 0x%lx) "
@@ -259,7 +569,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->avail;
-            ptr |= (uintptr_t)data << 32;
+            ptr = (ptr & 0xffffffffull) | ((uintptr_t)data << 32);
             virtq->avail = (struct virtq_avail *)ptr;
             // printf("VIRTIO MMIO|INFO: virtq avail 0x%lx\n.", ptr);
         } else {
@@ -273,7 +583,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->used;
-            ptr |= data;
+            ptr = (ptr & ~0xffffffffull) | data;
             virtq->used = (struct virtq_used *)ptr;
         } else {
             LOG_VMM_ERR("invalid virtq index 0x%lx (number of virtqs is 0x%lx) "
@@ -286,7 +596,7 @@ static bool handle_virtio_mmio_reg_write(virtio_device_t *dev, size_t vcpu_id, s
         if (dev->data.QueueSel < dev->num_vqs) {
             struct virtq *virtq = get_current_virtq_by_handler(dev);
             uintptr_t ptr = (uintptr_t)virtq->used;
-            ptr |= (uintptr_t)data << 32;
+            ptr = (ptr & 0xffffffffull) | ((uintptr_t)data << 32);
             virtq->used = (struct virtq_used *)ptr;
             // printf("VIRTIO MMIO|INFO: virtq used 0x%lx\n.", ptr);
         } else {
@@ -124,6 +124,19 @@ static const char *code_to_str(uint32_t code)
 
 static void virtio_snd_respond(struct virtio_device *dev)
 {
+    /* Responses may have been added to any of the virtqs, only interrupt the
+     * guest if it asked to be notified for at least one of them. */
+    bool notify = false;
+    for (int i = 0; i < VIRTIO_SND_NUM_VIRTQ; i++) {
+        if (dev->vqs[i].ready && virtio_mmio_vq_should_notify(dev, &dev->vqs[i])) {
+            notify = true;
+        }
+    }
+
+    if (!notify) {
+        return;
+    }
+
     dev->data.InterruptStatus = BIT_LOW(0);
     bool success = virq_inject(GUEST_VCPU_ID, dev->virq);
     assert(success);
@@ -328,21 +341,14 @@ static int handle_basic_cmd(struct virtio_device *dev,
     return 0;
 }
 
-static void virtq_enqueue_used(struct virtq *virtq, uint32_t desc_head, uint32_t bytes_written)
-{
-    struct virtq_used_elem *used_elem = &virtq->used->ring[virtq->used->idx % virtq->num];
-    used_elem->id = desc_head;
-    used_elem->len = bytes_written;
-    virtq->used->idx++;
-}
-
 // Returns number of bytes written to virtq
 static void handle_control_msg(struct virtio_device *dev,
-                               struct virtq *virtq,
+                               virtio_queue_handler_t *vq,
                                uint16_t desc_head,
                                bool *notify_driver,
                                bool *respond)
 {
+    struct virtq *virtq = &vq->virtq;
     struct virtq_desc *req_desc = &virtq->desc[desc_head];
     struct virtio_snd_hdr *hdr = (void *)req_desc->addr;
     struct virtio_snd_pcm_hdr *pcm_hdr = (void *)hdr;
@@ -419,7 +425,7 @@ static void handle_control_msg(struct virtio_device *dev,
     if (immediate) {
         *status_ptr = status;
         bytes_written += sizeof(uint32_t);
-        virtq_enqueue_used(virtq, desc_head, bytes_written);
+        virtio_mmio_vq_push(vq, desc_head, bytes_written);
     } else {
         *notify_driver = true;
         assert(bytes_written == 0);
@@ -523,11 +529,12 @@ static bool perform_xfer(struct virtio_device *dev,
 }
 
 static void handle_xfer(struct virtio_device *dev,
-                        struct virtq *virtq,
+                        virtio_queue_handler_t *vq,
                         uint16_t desc_head,
                         bool transmit,
                         bool *notify_driver, bool *respond)
 {
+    struct virtq *virtq = &vq->virtq;
     struct virtq_desc *req_desc = &virtq->desc[desc_head];
     struct virtio_snd_pcm_xfer *hdr = (void *)req_desc->addr;
 
@@ -561,7 +568,7 @@ static void handle_xfer(struct virtio_device *dev,
         uint32_t *status_ptr = (void *)desc->addr;
         *status_ptr = VIRTIO_SOUND_S_IO_ERR;
 
-        virtq_enqueue_used(virtq, desc_head, sizeof(uint32_t));
+        virtio_mmio_vq_push(vq, desc_head, sizeof(uint32_t));
         ialloc_free(&state->free_requests, cookie);
 
         *respond = true;
@@ -585,28 +592,25 @@ static void handle_virtq(struct virtio_device *dev,
                          int index, bool *notify_driver, bool *respond)
 {
     virtio_queue_handler_t *vq = &dev->vqs[index];
-    struct virtq *virtq = &vq->virtq;
-
-    uint16_t idx = vq->last_idx;
-    for (; idx != virtq->avail->idx; idx++) {
 
-        uint16_t desc_head = virtq->avail->ring[idx % virtq->num];
-
-        switch (index) {
-        case CONTROLQ:
-            handle_control_msg(dev, virtq, desc_head, notify_driver, respond);
-            break;
-        case TXQ:
-            handle_xfer(dev, virtq, desc_head, true, notify_driver, respond);
-            break;
-        case RXQ:
-            handle_xfer(dev, virtq, desc_head, false, notify_driver, respond);
-            break;
-        default:
-            LOG_SOUND_ERR("Queue %d not implemented", index);
+    uint16_t desc_head;
+    do {
+        while (virtio_mmio_vq_pop(vq, &desc_head)) {
+            switch (index) {
+            case CONTROLQ:
+                handle_control_msg(dev, vq, desc_head, notify_driver, respond);
+                break;
+            case TXQ:
+                handle_xfer(dev, vq, desc_head, true, notify_driver, respond);
+                break;
+            case RXQ:
+                handle_xfer(dev, vq, desc_head, false, notify_driver, respond);
+                break;
+            default:
+                LOG_SOUND_ERR("Queue %d not implemented", index);
+            }
         }
-    }
-    vq->last_idx = idx;
+    } while (virtio_mmio_vq_publish_avail_event(dev, vq));
 }
 
 static int virtio_snd_mmio_queue_notify(struct virtio_device *dev)
@@ -764,7 +768,8 @@ static bool respond_to_request(virtio_snd_request_t *req,
     uint16_t desc_head = req->desc_head;
 
     assert(req->virtq_idx < VIRTIO_SND_NUM_VIRTQ);
-    struct virtq *virtq = &dev->vqs[req->virtq_idx].virtq;
+    virtio_queue_handler_t *vq = &dev->vqs[req->virtq_idx];
+    struct virtq *virtq = &vq->virtq;
 
     struct virtq_desc *req_desc = &virtq->desc[desc_head];
     struct virtq_desc *res_desc = &virtq->desc[req_desc->next];
@@ -791,7 +796,7 @@ static bool respond_to_request(virtio_snd_request_t *req,
         used += response_len;
     }
     
-    virtq_enqueue_used(virtq, desc_head, used);
+    virtio_mmio_vq_push(vq, desc_head, used);
 
     return true;
 }
@@ -5,5 +5,37 @@
  */
 #pragma once
 
-/* Notify the VMM */
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Notify the VMM. Notifications are coalesced and sent once the driver has
+ * returned from handling the current event.
+ */
 void uio_notify();
+
+/*
+ * Busy-poll for up to us microseconds after each event before blocking again.
+ * The window adapts to the load and is only useful for drivers that implement
+ * driver_has_work. Zero, the default, disables polling.
+ */
+void uio_set_poll_window(unsigned us);
+
+/* Notify the VMM that owns a device opened with uio_open_device */
+void uio_notify_device(int device);
+
+/*
+ * Open /dev/uio<uio_num> in addition to the device given to driver_init, so
+ * that one process can serve several devices. notified is called whenever the
+ * device's IRQ is raised. The device's mappings are returned the same way as
+ * to driver_init. Returns the device to pass to uio_notify_device, or -1.
+ */
+int uio_open_device(int uio_num, void (*notified)(void), void ***maps, uintptr_t **maps_phys, int *num_maps);
+
+/*
+ * Have handler called from the main loop whenever fd becomes readable, for
+ * drivers that also wait on something other than the VMM, such as an eventfd
+ * or timerfd. Returns -1 if too many file descriptors have been registered or
+ * fd cannot be waited on.
+ */
+int uio_register_fd(int fd, void (*handler)(void));
@@ -12,10 +12,11 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <dirent.h>
 #include <regex.h>
 #include <limits.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,11 +42,41 @@
 
 #define MAX_PATHNAME 64
 #define UIO_MAX_MAPS 32
-
-static struct pollfd pfd;
-static void *maps[UIO_MAX_MAPS];
-static uintptr_t maps_phys[UIO_MAX_MAPS];
-static int num_maps;
+#define UIO_MAX_DEVICES 4
+#define UIO_MAX_FDS 16
+#define UIO_MAX_EVENTS (UIO_MAX_DEVICES + UIO_MAX_FDS)
+/* The adaptive polling window never shrinks below the configured window divided by this */
+#define POLL_WINDOW_MIN_DIVISOR 16
+
+typedef struct uio_device {
+    int fd;
+    int uio_num;
+    void *maps[UIO_MAX_MAPS];
+    uintptr_t maps_phys[UIO_MAX_MAPS];
+    int num_maps;
+    /* Called when the VMM raises the device's IRQ */
+    void (*notified)(void);
+    /* Set by uio_notify, the VMM is notified once the current batch of work is done */
+    bool notify_pending;
+} uio_device_t;
+
+/* What an epoll event is for, either a UIO device or a file descriptor registered by a driver */
+typedef struct uio_source {
+    uio_device_t *device;
+    void (*handler)(void);
+} uio_source_t;
+
+/* The device given to driver_init is always first, followed by any the driver opens itself */
+static uio_device_t devices[UIO_MAX_DEVICES];
+static int num_devices;
+static uio_source_t sources[UIO_MAX_EVENTS];
+static int num_sources;
+static int epoll_fd;
+
+/* Longest time to busy-poll for more work before blocking, zero disables polling */
+static uint64_t poll_window_max_ns;
+/* Current window, shrinks while polling finds nothing and grows back when it does */
+static uint64_t poll_window_ns;
 
 /*
  * Just happily abort if the user can't be bother to provide these functions
@@ -61,18 +92,163 @@ __attribute__((weak)) void driver_notified()
     assert(!"UIO driver did not implement driver_notified");
 }
 
-void uio_notify()
+/* Drivers that support polling override this to check their queues without a syscall */
+__attribute__((weak)) bool driver_has_work()
+{
+    return false;
+}
+
+static void uio_irq_enable(uio_device_t *device)
 {
     // writing 1 to the uio device re-enables/acks the IRQ
     int32_t one = 1;
-    int ret = write(pfd.fd, &one, 4);
+    int ret = write(device->fd, &one, 4);
     if (ret < 0) {
-        LOG_UIO_ERR("writing 1 to device failed with ret val: %d, errno: %d\n", ret, errno);
+        LOG_UIO_ERR("writing 1 to uio%d failed with ret val: %d, errno: %d\n", device->uio_num, ret, errno);
+    }
+}
+
+void uio_notify_device(int device)
+{
+    assert(device >= 0 && device < num_devices);
+    /* Coalesce every notification made while handling one batch of events */
+    devices[device].notify_pending = true;
+}
+
+void uio_notify()
+{
+    uio_notify_device(0);
+}
+
+static void uio_flush_notify()
+{
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].notify_pending) {
+            devices[i].notify_pending = false;
+            uio_irq_enable(&devices[i]);
+        }
+    }
+}
+
+void uio_set_poll_window(unsigned us)
+{
+    poll_window_max_ns = (uint64_t)us * 1000;
+    poll_window_ns = poll_window_max_ns;
+}
+
+static uint64_t uio_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax()
+{
+#if defined(__aarch64__)
+    asm volatile("yield");
+#elif defined(__x86_64__)
+    asm volatile("pause");
+#endif
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 to block) for IRQs from the UIO devices or
+ * for registered file descriptors to become readable, and dispatch each of them.
+ */
+static void uio_handle_events(int timeout)
+{
+    struct epoll_event events[UIO_MAX_EVENTS];
+    // epoll_wait() returns when there is something to read, for UIO devices that is when an IRQ occurs.
+    int num_events = epoll_wait(epoll_fd, events, UIO_MAX_EVENTS, timeout);
+    if (num_events < 0) {
+        if (errno != EINTR) {
+            LOG_UIO_ERR("epoll_wait failed, errno: %d\n", errno);
+        }
+        return;
+    }
+
+    for (int i = 0; i < num_events; i++) {
+        uio_source_t *source = events[i].data.ptr;
+        if (source->device == NULL) {
+            source->handler();
+            continue;
+        }
+
+        // actually ACK the IRQ by performing a read()
+        int irq_count;
+        int read_ret = read(source->device->fd, &irq_count, sizeof(irq_count));
+        (void)read_ret;
+        assert(read_ret >= 0);
+        LOG_UIO("received irq on uio%d, count: %d\n", source->device->uio_num, irq_count);
+
+        /* wake the guest driver up to do some real works */
+        source->device->notified();
     }
-    fsync(pfd.fd);
 }
 
-static int uio_num_maps()
+/*
+ * Spin on the driver's queues for up to the polling window after handling an
+ * event, so that work arriving shortly after is picked up without waiting for
+ * an interrupt. Every time work is found the window starts again. Only the
+ * first device is polled, so whenever it has work the other devices and the
+ * registered file descriptors are checked as well to keep them from starving.
+ */
+static void uio_busy_poll()
+{
+    if (poll_window_ns == 0) {
+        return;
+    }
+
+    bool found = false;
+    uint64_t deadline = uio_now_ns() + poll_window_ns;
+    while (uio_now_ns() < deadline) {
+        if (!driver_has_work()) {
+            cpu_relax();
+            continue;
+        }
+        found = true;
+        driver_notified();
+        uio_handle_events(0);
+        uio_flush_notify();
+        deadline = uio_now_ns() + poll_window_ns;
+    }
+
+    /* Stop burning the CPU as much when nothing turns up, but never stop polling entirely */
+    if (found) {
+        poll_window_ns = poll_window_max_ns;
+    } else if (poll_window_ns > poll_window_max_ns / POLL_WINDOW_MIN_DIVISOR) {
+        poll_window_ns /= 2;
+    }
+}
+
+static int uio_add_source(int fd, uio_device_t *device, void (*handler)(void))
+{
+    if (num_sources == UIO_MAX_EVENTS) {
+        LOG_UIO_ERR("Too many file descriptors registered, maximum is %d\n", UIO_MAX_EVENTS);
+        return -1;
+    }
+
+    uio_source_t *source = &sources[num_sources];
+    source->device = device;
+    source->handler = handler;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        LOG_UIO_ERR("Failed to add fd %d to epoll, errno: %d\n", fd, errno);
+        return -1;
+    }
+    num_sources++;
+
+    return 0;
+}
+
+int uio_register_fd(int fd, void (*handler)(void))
+{
+    return uio_add_source(fd, NULL, handler);
+}
+
+static int uio_num_maps(int uio_num)
 {
     DIR *dir;
     struct dirent *entry;
@@ -81,7 +257,7 @@ static int uio_num_maps()
     int count = 0;
 
     char path[MAX_PATHNAME];
-    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps", UIO_NUM);
+    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps", uio_num);
     if (len < 0 || len >= sizeof(path)) {
         LOG_UIO_ERR("Failed to create maps path string\n");
         return -1;
@@ -134,14 +310,14 @@ static int uio_num_maps()
     return count;
 }
 
-static int uio_map_size(int map_num)
+static int uio_map_size(int uio_num, int map_num)
 {
     char path[MAX_PATHNAME];
     char buf[MAX_PATHNAME];
 
-    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps/map%d/size", UIO_NUM, map_num);
+    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps/map%d/size", uio_num, map_num);
     if (len < 0 || len >= sizeof(path)) {
-        LOG_UIO_ERR("Failed to create uio%d map%d size path string\n", UIO_NUM, map_num);
+        LOG_UIO_ERR("Failed to create uio%d map%d size path string\n", uio_num, map_num);
         return -1;
     }
 
@@ -166,14 +342,14 @@ static int uio_map_size(int map_num)
     return size;
 }
 
-static int uio_map_addr(int map_num, uintptr_t *addr)
+static int uio_map_addr(int uio_num, int map_num, uintptr_t *addr)
 {
     char path[MAX_PATHNAME];
     char buf[MAX_PATHNAME];
 
-    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps/map%d/addr", UIO_NUM, map_num);
+    int len = snprintf(path, sizeof(path), "/sys/class/uio/uio%d/maps/map%d/addr", uio_num, map_num);
     if (len < 0 || len >= sizeof(path)) {
-        LOG_UIO_ERR("Failed to create uio%d map%d addr path string\n", UIO_NUM, map_num);
+        LOG_UIO_ERR("Failed to create uio%d map%d addr path string\n", uio_num, map_num);
         return -1;
     }
 
@@ -200,9 +376,10 @@ static int uio_map_addr(int map_num, uintptr_t *addr)
     return 0;
 }
 
-static int uio_map_init(int fd)
+static int uio_map_init(uio_device_t *device)
 {
-    num_maps = uio_num_maps();
+    int fd = device->fd;
+    int num_maps = uio_num_maps(device->uio_num);
     if (num_maps < 0) {
         LOG_UIO_ERR("Failed to get number of maps\n");
         return -1;
@@ -218,100 +395,121 @@ static int uio_map_init(int fd)
     }
 
     for (int i = 0; i < num_maps; i++) {
-        int size = uio_map_size(i);
+        int size = uio_map_size(device->uio_num, i);
         if (size < 0) {
             LOG_UIO_ERR("Failed to get size of map%d\n", i);
             close(fd);
             return -1;
         }
 
-        if (uio_map_addr(i, &maps_phys[i]) != 0) {
+        if (uio_map_addr(device->uio_num, i, &device->maps_phys[i]) != 0) {
             LOG_UIO_ERR("Failed to get addr of map%d\n", i);
             close(fd);
             return -1;
         }
 
-        if ((maps[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, i * getpagesize())) == NULL) {
+        if ((device->maps[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, i * getpagesize())) == MAP_FAILED) {
             LOG_UIO_ERR("mmap failed, errno: %d\n", errno);
             close(fd);
             return -1;
         }
-        LOG_UIO("mmaped map%d with 0x%x bytes at %p\n", i, size, maps[i]);
+        LOG_UIO("mmaped map%d with 0x%x bytes at %p\n", i, size, device->maps[i]);
     }
+    device->num_maps = num_maps;
 
     return 0;
 }
 
-int main(int argc, char **argv)
+/* Open /dev/uio<uio_num>, map its regions, enable its IRQ and add it to the event loop */
+static uio_device_t *uio_device_open(int uio_num, void (*notified)(void))
 {
-    if (argc < 2) {
-        printf("Usage: %s <uio_device_number> [driver_args...]\n", argv[0]);
-        return 1;
+    if (num_devices == UIO_MAX_DEVICES) {
+        LOG_UIO_ERR("Too many UIO devices, maximum is %d\n", UIO_MAX_DEVICES);
+        return NULL;
     }
+    uio_device_t *device = &devices[num_devices];
 
-    // append UIO_NUM to "/dev/uio" to get the full path of the uio device, e.g. "/dev/uio0"
+    // append the device number to "/dev/uio" to get the full path of the uio device, e.g. "/dev/uio0"
     char uio_device_name[MAX_PATHNAME];
-    int len = snprintf(uio_device_name, sizeof(uio_device_name), "/dev/uio%d", UIO_NUM);
+    int len = snprintf(uio_device_name, sizeof(uio_device_name), "/dev/uio%d", uio_num);
     if (len < 0 || len >= sizeof(uio_device_name)) {
         LOG_UIO_ERR("Failed to create uio device name\n");
-        printf("Usage: %s <uio_device_number> [driver_args...]\n", argv[0]);
-        return 1;
+        return NULL;
     }
 
-    // get the file descriptor for polling
-    pfd.fd = open(uio_device_name, O_RDWR);
-    if (pfd.fd < 0) {
+    device->fd = open(uio_device_name, O_RDWR);
+    if (device->fd < 0) {
         LOG_UIO_ERR("Failed to open %s\n", uio_device_name);
-        printf("Usage: %s <uio_device_number> [driver_args...]\n", argv[0]);
-        return 1;
+        return NULL;
     }
-
-    // the event we are polling for
-    pfd.events = POLLIN;
+    device->uio_num = uio_num;
+    device->notified = notified;
 
     /* Initialise UIO device mappings */
-    if (uio_map_init(pfd.fd) != 0) {
+    if (uio_map_init(device) != 0) {
         LOG_UIO_ERR("Failed to initialise UIO device mappings\n");
-        close(pfd.fd);
-        return 1;
+        close(device->fd);
+        return NULL;
     }
 
+    if (uio_add_source(device->fd, device, NULL) != 0) {
+        close(device->fd);
+        return NULL;
+    }
+    num_devices++;
+
     // Enable the uio interrupt
-    uio_notify();
+    uio_irq_enable(device);
+
+    return device;
+}
+
+int uio_open_device(int uio_num, void (*notified)(void), void ***maps, uintptr_t **maps_phys, int *num_maps)
+{
+    uio_device_t *device = uio_device_open(uio_num, notified);
+    if (device == NULL) {
+        return -1;
+    }
+
+    /* Skip the first mapping which only contains UIO's irq status */
+    *maps = device->maps + 1;
+    *maps_phys = device->maps_phys + 1;
+    *num_maps = device->num_maps - 1;
+
+    return device - devices;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("Usage: %s <uio_device_number> [driver_args...]\n", argv[0]);
+        return 1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOG_UIO_ERR("Failed to create epoll instance, errno: %d\n", errno);
+        return 1;
+    }
+
+    uio_device_t *device = uio_device_open(UIO_NUM, driver_notified);
+    if (device == NULL) {
+        return 1;
+    }
 
     /* Initialise driver */
     // Here we pass the UIO device mappings to the driver, skipping the first one which only contains UIO's irq status
-    if (driver_init(maps + 1, maps_phys + 1, num_maps - 1, argc - 1, argv + 1) != 0) {
+    if (driver_init(device->maps + 1, device->maps_phys + 1, device->num_maps - 1, argc - 1, argv + 1) != 0) {
         LOG_UIO_ERR("Failed to initialise driver\n");
-        close(pfd.fd);
+        close(device->fd);
         return 1;
     }
 
     while (true) {
-        // poll() returns when there is something to read, in our case, when there is an IRQ occur.
-        // poll() doesn't do anything with the IRQ.
-        int num_victims = poll(&pfd, 1, -1);
-
-        // TODO(@jade): handle this gracefully
-        (void)num_victims;
-        assert(num_victims != 0);
-        assert(num_victims != -1);
-        assert(pfd.revents == POLLIN);
-
-        // actually ACK the IRQ by performing a read()
-        int irq_count;
-        int read_ret = read(pfd.fd, &irq_count, sizeof(irq_count));
-        (void)read_ret;
-        assert(read_ret >= 0);
-        LOG_UIO("received irq, count: %d\n", irq_count);
-
-        /* clear the return event(s). */
-        pfd.revents = 0;
-
-        /* wake the guest driver up to do some real works */
-        driver_notified();
+        uio_handle_events(-1);
+        uio_flush_notify();
+        uio_busy_poll();
     }
 
     return 0;
 }
-
@@ -13,14 +13,19 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <linux/fs.h>
 
 #include <sddf/blk/queue.h>
+#include <libvmm/virtio/block_sddf.h>
 #include <blk_config.h>
 
 #include <uio/libuio.h>
 #include <uio/blk.h>
 
+#include "uring.h"
+#include "workers.h"
+
 /* Uncomment this to enable debug logging */
 // #define DEBUG_UIO_BLOCK
 
@@ -34,56 +39,329 @@
 
 #define STORAGE_MAX_PATHNAME 64
 
+/* Logical sector size reported for storage backed by a regular file */
+#define FILE_SECTOR_SIZE 512
+
+/* Maximum number of contiguous requests merged into one vectored read or write */
+#define MERGE_MAX_REQUESTS 64
+
+/* Number of requests the io_uring engine can have queued at once */
+#define URING_ENTRIES 256
+
 int storage_fd;
+/* Storage is a regular file, which may have holes, rather than a block device */
+bool storage_is_file;
+/* Serve requests asynchronously through io_uring rather than one at a time */
+bool use_uring;
+/* Serve requests on this many worker threads rather than on the event thread */
+int num_workers;
+
+/* Requests currently with the workers */
+static uint32_t workers_inflight;
+/* A FLUSH or BARRIER waiting for, or being served after, the requests before it */
+static bool barrier_held;
+static blk_work_t barrier;
 
 blk_storage_info_t *blk_config;
 blk_queue_handle_t h;
 uintptr_t blk_data;
 
-int driver_init(void **maps, uintptr_t *maps_phys, int num_maps, int argc, char **argv)
+static void uring_complete(uint32_t id, int res)
 {
-    LOG_UIO_BLOCK("Initialising...\n");
+    if (blk_resp_queue_full(&h)) {
+        LOG_UIO_BLOCK_ERR("Response ring is full, dropping response\n");
+        return;
+    }
 
-    if (num_maps != 4) {
-        LOG_UIO_BLOCK_ERR("Expecting 4 maps, got %d\n", num_maps);
-        return -1;
+    blk_response_status_t status = SUCCESS;
+    uint16_t success_count = 0;
+    if (res < 0) {
+        LOG_UIO_BLOCK_ERR("Request %d failed: %s\n", id, strerror(-res));
+        status = SEEK_ERROR;
+    } else {
+        success_count = res / BLK_TRANSFER_SIZE;
     }
 
-    if (argc != 1) {
-        LOG_UIO_BLOCK_ERR("Expecting 1 driver argument, got %d\n", argc);
-        return -1;
+    blk_enqueue_resp(&h, status, success_count, id);
+    LOG_UIO_BLOCK("Enqueued response: status=%d, success_count=%d, id=%d\n", status, success_count, id);
+}
+
+/* Called when io_uring requests have completed */
+static void uring_notified(void)
+{
+    if (blk_uring_reap(uring_complete) > 0) {
+        uio_notify();
     }
+}
 
-    char *storage_path = argv[0];
+/*
+ * Read from a regular file, filling holes with zeroes instead of reading them.
+ * Returns the number of bytes read or -1 on failure.
+ */
+static ssize_t read_sparse(void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        off_t pos = offset + done;
+        size_t left = len - done;
+
+        off_t data = lseek(storage_fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO) {
+                return -1;
+            }
+            /* Nothing but a hole from here to the end of the file */
+            data = offset + len;
+        }
+        if (data > pos) {
+            size_t hole = (size_t)(data - pos) < left ? (size_t)(data - pos) : left;
+            memset((char *)buf + done, 0, hole);
+            done += hole;
+            continue;
+        }
 
-    blk_config = (blk_storage_info_t *)maps[0];
-    blk_req_queue_t *req_queue = (blk_req_queue_t *)maps[1];
-    blk_resp_queue_t *resp_queue = (blk_resp_queue_t *)maps[2];
-    blk_data = (uintptr_t)maps[3];
+        off_t hole = lseek(storage_fd, pos, SEEK_HOLE);
+        if (hole < 0) {
+            return -1;
+        }
+        size_t chunk = (size_t)(hole - pos) < left ? (size_t)(hole - pos) : left;
+        ssize_t bytes_read = pread(storage_fd, (char *)buf + done, chunk, pos);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        done += bytes_read;
+        if ((size_t)bytes_read < chunk) {
+            break;
+        }
+    }
 
-    LOG_UIO_BLOCK("maps_phys[0]: 0x%lx, maps_phys[1]: 0x%lx, maps_phys[2]: 0x%lx, maps_phys[3]: 0x%lx\n", maps_phys[0],
-                  maps_phys[1], maps_phys[2], maps_phys[3]);
+    return done;
+}
 
-    blk_queue_init(&h, req_queue, resp_queue, BLK_QUEUE_SIZE_DRIV);
+/* Returns true if the file has no holes between offset and offset + len */
+static bool file_range_is_data(off_t offset, size_t len)
+{
+    return lseek(storage_fd, offset, SEEK_DATA) == offset && lseek(storage_fd, offset, SEEK_HOLE) >= offset + len;
+}
 
-    storage_fd = open(storage_path, O_RDWR);
-    if (storage_fd < 0) {
-        LOG_UIO_BLOCK_ERR("Failed to open storage drive: %s\n", strerror(errno));
-        return -1;
+/*
+ * Discard or zero a range of a file. Discarding punches a hole, zeroing keeps
+ * the range allocated where the filesystem allows it.
+ */
+static int file_discard(bool discard, uint64_t offset, uint64_t len)
+{
+    if (!discard && fallocate(storage_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+        return 0;
     }
-    LOG_UIO_BLOCK("Opened storage drive: %s\n", storage_path);
+    return fallocate(storage_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
 
-    struct stat storageStat;
-    if (fstat(storage_fd, &storageStat) < 0) {
-        LOG_UIO_BLOCK_ERR("Failed to get storage drive status: %s\n", strerror(errno));
-        return -1;
+/*
+ * Serve a single request with positional I/O so that it can run on any thread
+ * without racing on the file offset.
+ */
+static void serve_request(blk_work_t *work)
+{
+    work->status = SUCCESS;
+    work->success_count = 0;
+
+    /* The code is kept as an integer as it may be one of the libvmm extensions */
+    switch (work->code) {
+    case READ_BLOCKS: {
+        LOG_UIO_BLOCK("Reading from storage at mmaped address: 0x%lx\n", work->offset + blk_data);
+        void *buf = (void *)(work->offset + blk_data);
+        size_t len = work->count * BLK_TRANSFER_SIZE;
+        off_t storage_offset = (off_t)work->block_number * BLK_TRANSFER_SIZE;
+        ssize_t bytes_read = storage_is_file ? read_sparse(buf, len, storage_offset)
+                                             : pread(storage_fd, buf, len, storage_offset);
+        LOG_UIO_BLOCK("Read from storage successfully: %ld bytes\n", bytes_read);
+        if (bytes_read < 0) {
+            LOG_UIO_BLOCK_ERR("Failed to read from storage: %s\n", strerror(errno));
+            work->status = SEEK_ERROR;
+        } else {
+            work->success_count = bytes_read / BLK_TRANSFER_SIZE;
+        }
+        break;
+    }
+    case WRITE_BLOCKS: {
+        LOG_UIO_BLOCK("Writing to storage at mmaped address: 0x%lx\n", work->offset + blk_data);
+        ssize_t bytes_written = pwrite(storage_fd, (void *)(work->offset + blk_data), work->count * BLK_TRANSFER_SIZE,
+                                       (off_t)work->block_number * BLK_TRANSFER_SIZE);
+        LOG_UIO_BLOCK("Wrote to storage successfully: %ld bytes\n", bytes_written);
+        if (bytes_written < 0) {
+            LOG_UIO_BLOCK_ERR("Failed to write to storage: %s\n", strerror(errno));
+            work->status = SEEK_ERROR;
+        } else {
+            work->success_count = bytes_written / BLK_TRANSFER_SIZE;
+        }
+        break;
     }
+    case FLUSH:
+    case BARRIER: {
+        int ret = fsync(storage_fd);
+        if (ret != 0) {
+            LOG_UIO_BLOCK_ERR("Failed to flush storage: %s\n", strerror(errno));
+            work->status = SEEK_ERROR;
+        }
+        break;
+    }
+    case BLK_REQ_DISCARD:
+    case BLK_REQ_WRITE_ZEROES: {
+        uint64_t range[2] = { (uint64_t)work->block_number * BLK_TRANSFER_SIZE,
+                              (uint64_t)work->count * BLK_TRANSFER_SIZE };
+        bool discard = work->code == BLK_REQ_DISCARD;
+        LOG_UIO_BLOCK("%s %d blocks at block %d\n", discard ? "Discarding" : "Zeroing", work->count,
+                      work->block_number);
+        int ret = storage_is_file ? file_discard(discard, range[0], range[1])
+                                  : ioctl(storage_fd, discard ? BLKDISCARD : BLKZEROOUT, &range);
+        if (ret == -1) {
+            LOG_UIO_BLOCK_ERR("Failed to %s storage: %s\n", discard ? "discard" : "zero", strerror(errno));
+            work->status = SEEK_ERROR;
+        } else {
+            work->success_count = work->count;
+        }
+        break;
+    }
+    default:
+        /* Still respond so the request is not leaked on the other side */
+        LOG_UIO_BLOCK_ERR("Unknown command code: %d\n", work->code);
+        work->status = SEEK_ERROR;
+        break;
+    }
+}
 
-    if (!S_ISBLK(storageStat.st_mode)) {
-        LOG_UIO_BLOCK_ERR("Storage drive is of an unsupported type\n");
-        return -1;
+static void respond(blk_work_t *work)
+{
+    if (blk_resp_queue_full(&h)) {
+        LOG_UIO_BLOCK_ERR("Response ring is full, dropping response\n");
+        return;
+    }
+
+    blk_enqueue_resp(&h, work->status, work->success_count, work->id);
+    LOG_UIO_BLOCK("Enqueued response: status=%d, success_count=%d, id=%d\n", work->status, work->success_count,
+                  work->id);
+}
+
+/*
+ * Serve a run of reads or writes to contiguous blocks with a single vectored
+ * call, then split the bytes transferred back out over the requests in order.
+ */
+static void serve_run(blk_work_t *run, int len)
+{
+    if (len == 1) {
+        serve_request(&run[0]);
+        respond(&run[0]);
+        return;
+    }
+
+    struct iovec iov[MERGE_MAX_REQUESTS];
+    for (int i = 0; i < len; i++) {
+        iov[i].iov_base = (void *)(run[i].offset + blk_data);
+        iov[i].iov_len = run[i].count * BLK_TRANSFER_SIZE;
+    }
+
+    off_t storage_offset = (off_t)run[0].block_number * BLK_TRANSFER_SIZE;
+    if (storage_is_file && run[0].code == READ_BLOCKS) {
+        size_t run_size = 0;
+        for (int i = 0; i < len; i++) {
+            run_size += iov[i].iov_len;
+        }
+        if (!file_range_is_data(storage_offset, run_size)) {
+            /* Let each request skip the holes on its own */
+            for (int i = 0; i < len; i++) {
+                serve_request(&run[i]);
+                respond(&run[i]);
+            }
+            return;
+        }
     }
 
+    LOG_UIO_BLOCK("%s %d merged requests at block %d\n", run[0].code == WRITE_BLOCKS ? "Writing" : "Reading", len,
+                  run[0].block_number);
+    ssize_t bytes = run[0].code == WRITE_BLOCKS ? pwritev(storage_fd, iov, len, storage_offset)
+                                                 : preadv(storage_fd, iov, len, storage_offset);
+    if (bytes < 0) {
+        /* Serve them one at a time so a bad block only fails its own request */
+        LOG_UIO_BLOCK_ERR("Merged request failed, retrying individually: %s\n", strerror(errno));
+        for (int i = 0; i < len; i++) {
+            serve_request(&run[i]);
+            respond(&run[i]);
+        }
+        return;
+    }
+
+    for (int i = 0; i < len; i++) {
+        size_t transferred = (size_t)bytes < iov[i].iov_len ? (size_t)bytes : iov[i].iov_len;
+        bytes -= transferred;
+        run[i].status = SUCCESS;
+        run[i].success_count = transferred / BLK_TRANSFER_SIZE;
+        respond(&run[i]);
+    }
+}
+
+static void worker_complete(blk_work_t *work)
+{
+    workers_inflight--;
+    if (work->code == FLUSH || work->code == BARRIER) {
+        /* Only the barrier can have been in flight while it was held */
+        barrier_held = false;
+    }
+
+    respond(work);
+}
+
+/*
+ * Hand requests to the workers until the request queue is empty or they are
+ * all busy. A FLUSH or BARRIER is held back until every request before it has
+ * completed, and nothing after it is handed over until it has completed itself.
+ */
+static void workers_dispatch(void)
+{
+    while (true) {
+        if (barrier_held) {
+            if (workers_inflight > 0) {
+                /* Either requests before the barrier or the barrier itself */
+                return;
+            }
+            blk_workers_submit(&barrier);
+            workers_inflight++;
+            return;
+        }
+
+        if (blk_req_queue_empty(&h) || !blk_workers_has_space()) {
+            return;
+        }
+
+        blk_request_code_t req_code;
+        blk_work_t work = { 0 };
+        blk_dequeue_req(&h, &req_code, &work.offset, &work.block_number, &work.count, &work.id);
+        work.code = req_code;
+        LOG_UIO_BLOCK("Received command: code=%d, offset=0x%lx, block_number=%d, count=%d, id=%d\n", work.code,
+                      work.offset, work.block_number, work.count, work.id);
+
+        if (work.code == FLUSH || work.code == BARRIER) {
+            barrier = work;
+            barrier_held = true;
+            continue;
+        }
+
+        blk_workers_submit(&work);
+        workers_inflight++;
+    }
+}
+
+/* Called when requests handed to the workers have completed */
+static void workers_notified(void)
+{
+    if (blk_workers_reap(worker_complete) > 0) {
+        /* Completions may have released a barrier or made room */
+        workers_dispatch();
+        uio_notify();
+    }
+}
+
+static int block_device_init(void)
+{
     /* Set drive as read-write */
     int read_only_set = 0;
     if (ioctl(storage_fd, BLKROSET, &read_only_set) == -1) {
@@ -118,10 +396,179 @@ int driver_init(void **maps, uintptr_t *maps_phys, int num_maps, int argc, char
     LOG_UIO_BLOCK("Raw block device: read_only=%d, sector_size=%d, size=%ld\n", (int)blk_config->read_only,
                   blk_config->sector_size, blk_config->size);
 
+    return 0;
+}
+
+/*
+ * Back the disk with a regular file, typically a sparse image. If size is
+ * larger than the file it is extended with a hole, which costs no storage.
+ */
+static int file_init(struct stat *stat, uint64_t size)
+{
+    if (size > (uint64_t)stat->st_size) {
+        if (ftruncate(storage_fd, size) != 0) {
+            LOG_UIO_BLOCK_ERR("Failed to grow storage file to %lu bytes: %s\n", size, strerror(errno));
+            return -1;
+        }
+    } else {
+        size = stat->st_size;
+    }
+
+    storage_is_file = true;
+    /* We opened it read-write, so it is not read only */
+    blk_config->read_only = false;
+    blk_config->sector_size = FILE_SECTOR_SIZE;
+    blk_config->capacity = size / BLK_TRANSFER_SIZE;
+
+    LOG_UIO_BLOCK("File image: sector_size=%d, size=%lu\n", blk_config->sector_size, size);
+
+    return 0;
+}
+
+int driver_init(void **maps, uintptr_t *maps_phys, int num_maps, int argc, char **argv)
+{
+    LOG_UIO_BLOCK("Initialising...\n");
+
+    if (num_maps != 4) {
+        LOG_UIO_BLOCK_ERR("Expecting 4 maps, got %d\n", num_maps);
+        return -1;
+    }
+
+    if (argc < 1) {
+        LOG_UIO_BLOCK_ERR("Expecting at least 1 driver argument, got %d\n", argc);
+        return -1;
+    }
+
+    char *storage_path = argv[0];
+
+    /* Any other arguments select how requests are served:
+     *   uring     - submit requests with io_uring instead of serving them synchronously
+     *   workers=N - serve requests on a pool of N I/O threads
+     *   direct    - open the storage with O_DIRECT to bypass the page cache
+     *   size=N    - grow a file backed disk to N bytes, with an optional K, M or G suffix
+     *   poll=US   - busy-poll for up to US microseconds after each event before blocking */
+    bool direct = false;
+    uint64_t file_size = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "uring") == 0) {
+            use_uring = true;
+        } else if (strncmp(argv[i], "workers=", strlen("workers=")) == 0) {
+            char *end;
+            long num = strtol(argv[i] + strlen("workers="), &end, 10);
+            if (*end != '\0' || num < 1 || num > BLK_WORKERS_MAX) {
+                LOG_UIO_BLOCK_ERR("Number of workers must be between 1 and %d: %s\n", BLK_WORKERS_MAX, argv[i]);
+                return -1;
+            }
+            num_workers = num;
+        } else if (strncmp(argv[i], "size=", strlen("size=")) == 0) {
+            char *end;
+            file_size = strtoull(argv[i] + strlen("size="), &end, 10);
+            switch (*end) {
+            case 'G':
+                file_size <<= 10;
+                /* fallthrough */
+            case 'M':
+                file_size <<= 10;
+                /* fallthrough */
+            case 'K':
+                file_size <<= 10;
+                end++;
+                break;
+            }
+            if (*end != '\0' || file_size == 0) {
+                LOG_UIO_BLOCK_ERR("Invalid storage size: %s\n", argv[i]);
+                return -1;
+            }
+        } else if (strncmp(argv[i], "poll=", strlen("poll=")) == 0) {
+            char *end;
+            unsigned long us = strtoul(argv[i] + strlen("poll="), &end, 10);
+            if (*end != '\0' || us > UINT32_MAX) {
+                LOG_UIO_BLOCK_ERR("Invalid polling window: %s\n", argv[i]);
+                return -1;
+            }
+            uio_set_poll_window(us);
+        } else if (strcmp(argv[i], "direct") == 0) {
+            direct = true;
+        } else {
+            LOG_UIO_BLOCK_ERR("Unknown driver argument: %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (use_uring && num_workers > 0) {
+        LOG_UIO_BLOCK_ERR("Only one of uring and workers can be used\n");
+        return -1;
+    }
+
+    blk_config = (blk_storage_info_t *)maps[0];
+    blk_req_queue_t *req_queue = (blk_req_queue_t *)maps[1];
+    blk_resp_queue_t *resp_queue = (blk_resp_queue_t *)maps[2];
+    blk_data = (uintptr_t)maps[3];
+
+    LOG_UIO_BLOCK("maps_phys[0]: 0x%lx, maps_phys[1]: 0x%lx, maps_phys[2]: 0x%lx, maps_phys[3]: 0x%lx\n", maps_phys[0],
+                  maps_phys[1], maps_phys[2], maps_phys[3]);
+
+    blk_queue_init(&h, req_queue, resp_queue, BLK_QUEUE_SIZE_DRIV);
+
+    storage_fd = open(storage_path, O_RDWR | (direct ? O_DIRECT : 0));
+    if (storage_fd < 0) {
+        LOG_UIO_BLOCK_ERR("Failed to open storage drive: %s\n", strerror(errno));
+        return -1;
+    }
+    LOG_UIO_BLOCK("Opened storage drive: %s\n", storage_path);
+
+    if (direct && pread(storage_fd, (void *)blk_data, BLK_TRANSFER_SIZE, 0) < 0) {
+        /* The kernel has to be able to pin the data region for O_DIRECT, which
+         * is not always possible for UIO mappings */
+        LOG_UIO_BLOCK_ERR("O_DIRECT not usable with the data region, falling back to buffered I/O: %s\n",
+                          strerror(errno));
+        close(storage_fd);
+        storage_fd = open(storage_path, O_RDWR);
+        if (storage_fd < 0) {
+            LOG_UIO_BLOCK_ERR("Failed to open storage drive: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    struct stat storageStat;
+    if (fstat(storage_fd, &storageStat) < 0) {
+        LOG_UIO_BLOCK_ERR("Failed to get storage drive status: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (S_ISREG(storageStat.st_mode)) {
+        if (file_init(&storageStat, file_size) != 0) {
+            return -1;
+        }
+    } else if (S_ISBLK(storageStat.st_mode)) {
+        if (block_device_init() != 0) {
+            return -1;
+        }
+    } else {
+        LOG_UIO_BLOCK_ERR("Storage drive is of an unsupported type\n");
+        return -1;
+    }
+
     /* Optimal size */
     /* As far as I know linux does not let you query this from userspace, set as 0 to mean undefined */
     blk_config->block_size = 0;
 
+    if (use_uring) {
+        int event_fd = blk_uring_init(storage_fd, (void *)blk_data, BLK_DATA_REGION_SIZE_DRIV, URING_ENTRIES);
+        if (event_fd < 0 || uio_register_fd(event_fd, uring_notified) != 0) {
+            LOG_UIO_BLOCK_ERR("Failed to initialise io_uring, falling back to synchronous I/O\n");
+            use_uring = false;
+        }
+    }
+
+    if (num_workers > 0) {
+        int event_fd = blk_workers_init(num_workers, serve_request);
+        if (event_fd < 0 || uio_register_fd(event_fd, workers_notified) != 0) {
+            LOG_UIO_BLOCK_ERR("Failed to start workers, falling back to synchronous I/O\n");
+            num_workers = 0;
+        }
+    }
+
     /* Driver is ready to go, set ready in shared config page */
     __atomic_store_n(&blk_config->ready, true, __ATOMIC_RELEASE);
 
@@ -130,96 +577,85 @@ int driver_init(void **maps, uintptr_t *maps_phys, int num_maps, int argc, char
     return 0;
 }
 
+/* Lets libuio poll for requests and completions without waiting for an interrupt */
+bool driver_has_work()
+{
+    return !blk_req_queue_empty(&h) || (use_uring && blk_uring_has_completions())
+           || (num_workers > 0 && blk_workers_has_completions());
+}
+
 void driver_notified()
 {
+    if (num_workers > 0) {
+        /* When polling we get here for completions as well as new requests */
+        blk_workers_reap(worker_complete);
+        workers_dispatch();
+        uio_notify();
+        LOG_UIO_BLOCK("Notified other side\n");
+        return;
+    }
+
     blk_request_code_t req_code;
     uintptr_t req_offset;
     uint32_t req_block_number;
     uint16_t req_count;
     uint32_t req_id;
+    /* Contiguous reads or writes waiting to be served together */
+    blk_work_t run[MERGE_MAX_REQUESTS];
+    int run_len = 0;
+
+    if (use_uring) {
+        blk_uring_reap(uring_complete);
+    }
 
     while (!blk_req_queue_empty(&h)) {
         blk_dequeue_req(&h, &req_code, &req_offset, &req_block_number, &req_count, &req_id);
         LOG_UIO_BLOCK("Received command: code=%d, offset=0x%lx, block_number=%d, count=%d, id=%d\n", req_code, req_offset,
                       req_block_number, req_count, req_id);
 
-        blk_response_status_t status = SUCCESS;
-        uint16_t success_count = 0;
-
-        if (blk_resp_queue_full(&h)) {
-            LOG_UIO_BLOCK_ERR("Response ring is full, dropping response\n");
-            continue;
-        }
-
-        switch (req_code) {
-        case READ_BLOCKS: {
-            int ret = lseek(storage_fd, (off_t)req_block_number * BLK_TRANSFER_SIZE, SEEK_SET);
-            if (ret < 0) {
-                LOG_UIO_BLOCK_ERR("Failed to seek in storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
-                success_count = 0;
-                break;
-            }
-            LOG_UIO_BLOCK("Reading from storage at mmaped address: 0x%lx\n", req_offset + blk_data);
-            int bytes_read = read(storage_fd, (void *)(req_offset + blk_data), req_count * BLK_TRANSFER_SIZE);
-            LOG_UIO_BLOCK("Read from storage successfully: %d bytes\n", bytes_read);
-            if (bytes_read < 0) {
-                LOG_UIO_BLOCK_ERR("Failed to read from storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
-                success_count = 0;
-            } else {
-                status = SUCCESS;
-                success_count = bytes_read / BLK_TRANSFER_SIZE;
-            }
-            break;
-        }
-        case WRITE_BLOCKS: {
-            int ret = lseek(storage_fd, (off_t)req_block_number * BLK_TRANSFER_SIZE, SEEK_SET);
-            if (ret < 0) {
-                LOG_UIO_BLOCK_ERR("Failed to seek in storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
-                success_count = 0;
-                break;
+        if (use_uring && (req_code == READ_BLOCKS || req_code == WRITE_BLOCKS || req_code == FLUSH
+                          || req_code == BARRIER)) {
+            if (!blk_uring_has_space()) {
+                /* Make room by waiting for some of the requests in flight */
+                blk_uring_submit(true);
+                blk_uring_reap(uring_complete);
             }
-            LOG_UIO_BLOCK("Writing to storage at mmaped address: 0x%lx\n", req_offset + blk_data);
-            int bytes_written = write(storage_fd, (void *)(req_offset + blk_data), req_count * BLK_TRANSFER_SIZE);
-            LOG_UIO_BLOCK("Wrote to storage successfully: %d bytes\n", bytes_written);
-            if (bytes_written < 0) {
-                LOG_UIO_BLOCK_ERR("Failed to write to storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
-                success_count = 0;
-            } else {
-                status = SUCCESS;
-                success_count = bytes_written / BLK_TRANSFER_SIZE;
-            }
-            break;
-        }
-        case FLUSH: {
-            int ret = fsync(storage_fd);
-            if (ret != 0) {
-                LOG_UIO_BLOCK_ERR("Failed to flush storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
+            if (req_code == READ_BLOCKS || req_code == WRITE_BLOCKS) {
+                blk_uring_queue_rw(req_code == WRITE_BLOCKS, req_offset, (uint64_t)req_block_number * BLK_TRANSFER_SIZE,
+                                   req_count * BLK_TRANSFER_SIZE, req_id);
             } else {
-                status = SUCCESS;
+                blk_uring_queue_fsync(req_id);
             }
-            break;
+            continue;
         }
-        case BARRIER: {
-            int ret = fsync(storage_fd);
-            if (ret != 0) {
-                LOG_UIO_BLOCK_ERR("Failed to flush storage: %s\n", strerror(errno));
-                status = SEEK_ERROR;
-            } else {
-                status = SUCCESS;
-            }
-            break;
+
+        blk_work_t work = { req_code, req_offset, req_block_number, req_count, req_id };
+        bool mergeable = req_code == READ_BLOCKS || req_code == WRITE_BLOCKS;
+
+        if (run_len > 0
+            && (!mergeable || run_len == MERGE_MAX_REQUESTS || req_code != run[0].code
+                || req_block_number != run[run_len - 1].block_number + run[run_len - 1].count)) {
+            /* Anything that does not extend the run ends it, which keeps requests in order */
+            serve_run(run, run_len);
+            run_len = 0;
         }
-        default:
-            LOG_UIO_BLOCK_ERR("Unknown command code: %d\n", req_code);
+
+        if (mergeable) {
+            run[run_len++] = work;
             continue;
         }
-        blk_enqueue_resp(&h, status, success_count, req_id);
-        LOG_UIO_BLOCK("Enqueued response: status=%d, success_count=%d, id=%d\n", status, success_count, req_id);
+
+        serve_request(&work);
+        respond(&work);
+    }
+
+    if (run_len > 0) {
+        serve_run(run, run_len);
+    }
+
+    if (use_uring) {
+        /* Everything we dequeued goes to the kernel at once */
+        blk_uring_submit(false);
     }
 
     uio_notify();
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/* Uncomment this to enable debug logging */
+// #define DEBUG_UIO_BLOCK_URING
+
+#if defined(DEBUG_UIO_BLOCK_URING)
+#define LOG_URING(...) do{ printf("UIO_DRIVER(BLOCK_URING)"); printf(": "); printf(__VA_ARGS__); }while(0)
+#else
+#define LOG_URING(...) do{}while(0)
+#endif
+
+#define LOG_URING_ERR(...) do{ printf("UIO_DRIVER(BLOCK_URING)"); printf("|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/*
+ * We use the io_uring system calls directly rather than liburing so that the
+ * driver has no dependencies beyond the C library.
+ */
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct {
+    int ring_fd;
+    int event_fd;
+    int storage_fd;
+    uintptr_t data;
+    /* The data region is registered as fixed buffer 0 */
+    bool fixed;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    /* Entries queued since the last submit */
+    unsigned to_submit;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    unsigned cq_entries;
+    struct io_uring_cqe *cqes;
+
+    /* Requests submitted that we have not reaped, kept below cq_entries so
+     * that the completion queue never overflows */
+    unsigned inflight;
+} uring;
+
+int blk_uring_init(int storage_fd, void *data, size_t data_size, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring.ring_fd = io_uring_setup(entries, &params);
+    if (uring.ring_fd < 0) {
+        LOG_URING_ERR("Failed to set up io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    void *sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+                         IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        LOG_URING_ERR("Failed to map submission queue: %s\n", strerror(errno));
+        return -1;
+    }
+
+    void *cq_ring = sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.ring_fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            LOG_URING_ERR("Failed to map completion queue: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    uring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.ring_fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        LOG_URING_ERR("Failed to map submission queue entries: %s\n", strerror(errno));
+        return -1;
+    }
+
+    uring.sq_head = (unsigned *)((uintptr_t)sq_ring + params.sq_off.head);
+    uring.sq_tail = (unsigned *)((uintptr_t)sq_ring + params.sq_off.tail);
+    uring.sq_array = (unsigned *)((uintptr_t)sq_ring + params.sq_off.array);
+    uring.sq_mask = *(unsigned *)((uintptr_t)sq_ring + params.sq_off.ring_mask);
+    uring.sq_entries = params.sq_entries;
+
+    uring.cq_head = (unsigned *)((uintptr_t)cq_ring + params.cq_off.head);
+    uring.cq_tail = (unsigned *)((uintptr_t)cq_ring + params.cq_off.tail);
+    uring.cqes = (struct io_uring_cqe *)((uintptr_t)cq_ring + params.cq_off.cqes);
+    uring.cq_mask = *(unsigned *)((uintptr_t)cq_ring + params.cq_off.ring_mask);
+    uring.cq_entries = params.cq_entries;
+
+    uring.storage_fd = storage_fd;
+    uring.data = (uintptr_t)data;
+
+    /* Registering the data region saves the kernel from mapping it for every
+     * request. This fails for memory it cannot pin, which may be the case for
+     * UIO mappings, in which case we carry on without it. */
+    struct iovec iov = { .iov_base = data, .iov_len = data_size };
+    if (io_uring_register(uring.ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+        uring.fixed = true;
+    } else {
+        LOG_URING("Could not register data region, not using fixed buffers: %s\n", strerror(errno));
+        uring.fixed = false;
+    }
+
+    uring.event_fd = eventfd(0, EFD_NONBLOCK);
+    if (uring.event_fd < 0) {
+        LOG_URING_ERR("Failed to create eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (io_uring_register(uring.ring_fd, IORING_REGISTER_EVENTFD, &uring.event_fd, 1) != 0) {
+        LOG_URING_ERR("Failed to register eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    LOG_URING("Initialised with %u entries, fixed buffers: %d\n", uring.sq_entries, uring.fixed);
+
+    return uring.event_fd;
+}
+
+bool blk_uring_has_space(void)
+{
+    unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *uring.sq_tail + uring.to_submit;
+    return tail - head < uring.sq_entries && uring.inflight + uring.to_submit < uring.cq_entries;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    assert(blk_uring_has_space());
+
+    unsigned index = (*uring.sq_tail + uring.to_submit) & uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[index] = index;
+    uring.to_submit++;
+
+    return sqe;
+}
+
+void blk_uring_queue_rw(bool write, uintptr_t data_offset, uint64_t storage_offset, uint32_t len, uint32_t id)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (uring.fixed) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = uring.storage_fd;
+    sqe->addr = uring.data + data_offset;
+    sqe->len = len;
+    sqe->off = storage_offset;
+    sqe->user_data = id;
+}
+
+void blk_uring_queue_fsync(uint32_t id)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = uring.storage_fd;
+    /* Act as a barrier for everything queued before */
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = id;
+}
+
+void blk_uring_submit(bool wait)
+{
+    unsigned to_submit = uring.to_submit;
+    if (to_submit == 0 && !wait) {
+        return;
+    }
+
+    /* Make the entries visible to the kernel */
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + to_submit, __ATOMIC_RELEASE);
+    uring.to_submit = 0;
+    uring.inflight += to_submit;
+
+    int ret;
+    do {
+        ret = io_uring_enter(uring.ring_fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        LOG_URING_ERR("Failed to submit requests: %s\n", strerror(errno));
+    }
+
+    LOG_URING("Submitted %u requests, %u in flight\n", to_submit, uring.inflight);
+}
+
+bool blk_uring_has_completions(void)
+{
+    return *uring.cq_head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+}
+
+int blk_uring_reap(blk_uring_complete_fn complete)
+{
+    /* Clear the eventfd before looking at the queue so no completion is missed */
+    uint64_t count;
+    int ret = read(uring.event_fd, &count, sizeof(count));
+    (void)ret;
+
+    int reaped = 0;
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq_mask];
+        complete(cqe->user_data, cqe->res);
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    uring.inflight -= reaped;
+
+    return reaped;
+}
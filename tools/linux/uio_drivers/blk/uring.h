@@ -0,0 +1,50 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * io_uring engine for the UIO block driver. Requests are queued as they are
+ * dequeued from sDDF, submitted to the kernel in one go and completed
+ * asynchronously, see blk_uring_reap.
+ */
+
+/* Called for every completed request, res is the number of bytes transferred or a negative errno */
+typedef void (*blk_uring_complete_fn)(uint32_t id, int res);
+
+/*
+ * Set up an io_uring with room for entries requests against storage_fd. The data
+ * region is registered with the kernel if possible. Returns an eventfd that becomes
+ * readable when requests complete, or -1 on failure.
+ */
+int blk_uring_init(int storage_fd, void *data, size_t data_size, unsigned entries);
+
+/* Queue a read or write of len bytes between the data region and the storage */
+void blk_uring_queue_rw(bool write, uintptr_t data_offset, uint64_t storage_offset, uint32_t len, uint32_t id);
+
+/* Queue an fsync that only starts once every request queued before it has completed */
+void blk_uring_queue_fsync(uint32_t id);
+
+/*
+ * Returns true if another request can be queued. If not, the caller should
+ * blk_uring_submit with wait set.
+ */
+bool blk_uring_has_space(void);
+
+/*
+ * Submit all queued requests to the kernel. If wait is set, also waits for at
+ * least one request to complete.
+ */
+void blk_uring_submit(bool wait);
+
+/* Returns true if there are completed requests to reap, without entering the kernel */
+bool blk_uring_has_completions(void);
+
+/* Calls complete for every completed request, returns how many there were */
+int blk_uring_reap(blk_uring_complete_fn complete);
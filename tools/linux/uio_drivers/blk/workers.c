@@ -0,0 +1,190 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+
+#include "workers.h"
+
+#define LOG_BLK_WORKERS_ERR(...) do{ printf("UIO_DRIVER(BLOCK)"); printf("|ERROR: "); printf(__VA_ARGS__); }while(0)
+
+/* Number of requests each worker can have outstanding, must be a power of two */
+#define WORKER_QUEUE_SIZE 256
+
+typedef struct work_ring {
+    /* Next item to consume, only written by the consumer */
+    uint32_t head;
+    /* Next item to produce, only written by the producer */
+    uint32_t tail;
+    blk_work_t items[WORKER_QUEUE_SIZE];
+} work_ring_t;
+
+typedef struct worker {
+    pthread_t thread;
+    /* Counts the requests in the submit ring, the worker sleeps on it when idle */
+    sem_t pending;
+    /* Event thread to worker */
+    work_ring_t submit;
+    /* Worker to event thread */
+    work_ring_t done;
+    /* Requests handed to this worker that have not been reaped yet. Bounding
+     * this by the ring size means neither ring can overflow. Only used by the
+     * event thread. */
+    uint32_t outstanding;
+} worker_t;
+
+static worker_t workers[BLK_WORKERS_MAX];
+static int num_workers;
+/* Where to start looking for the least busy worker, so ties are spread around */
+static int next_worker;
+static int done_fd = -1;
+static blk_work_fn serve_fn;
+
+static void ring_push(work_ring_t *ring, const blk_work_t *work)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    assert(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < WORKER_QUEUE_SIZE);
+    ring->items[tail % WORKER_QUEUE_SIZE] = *work;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool ring_pop(work_ring_t *ring, blk_work_t *work)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *work = ring->items[head % WORKER_QUEUE_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *worker = arg;
+    blk_work_t work;
+    uint64_t one = 1;
+
+    while (true) {
+        if (sem_wait(&worker->pending) != 0) {
+            /* Interrupted by a signal */
+            continue;
+        }
+        bool popped = ring_pop(&worker->submit, &work);
+        assert(popped);
+        (void)popped;
+
+        serve_fn(&work);
+
+        ring_push(&worker->done, &work);
+        if (write(done_fd, &one, sizeof(one)) != sizeof(one)) {
+            LOG_BLK_WORKERS_ERR("Failed to signal completion: %s\n", strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+int blk_workers_init(int num, blk_work_fn serve)
+{
+    if (num < 1 || num > BLK_WORKERS_MAX) {
+        LOG_BLK_WORKERS_ERR("Invalid number of workers %d, must be between 1 and %d\n", num, BLK_WORKERS_MAX);
+        return -1;
+    }
+
+    done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_fd < 0) {
+        LOG_BLK_WORKERS_ERR("Failed to create eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    serve_fn = serve;
+    for (int i = 0; i < num; i++) {
+        worker_t *worker = &workers[i];
+        if (sem_init(&worker->pending, 0, 0) != 0) {
+            LOG_BLK_WORKERS_ERR("Failed to initialise worker semaphore: %s\n", strerror(errno));
+            return -1;
+        }
+        int err = pthread_create(&worker->thread, NULL, worker_main, worker);
+        if (err != 0) {
+            /* Workers that did start stay idle as nothing is ever handed to them */
+            LOG_BLK_WORKERS_ERR("Failed to start worker %d: %s\n", i, strerror(err));
+            return -1;
+        }
+    }
+    num_workers = num;
+
+    return done_fd;
+}
+
+static worker_t *least_busy_worker(void)
+{
+    worker_t *best = &workers[next_worker];
+    for (int i = 1; i < num_workers && best->outstanding != 0; i++) {
+        worker_t *worker = &workers[(next_worker + i) % num_workers];
+        if (worker->outstanding < best->outstanding) {
+            best = worker;
+        }
+    }
+    return best;
+}
+
+bool blk_workers_has_space(void)
+{
+    return least_busy_worker()->outstanding < WORKER_QUEUE_SIZE;
+}
+
+void blk_workers_submit(const blk_work_t *work)
+{
+    worker_t *worker = least_busy_worker();
+    assert(worker->outstanding < WORKER_QUEUE_SIZE);
+    next_worker = (next_worker + 1) % num_workers;
+
+    worker->outstanding++;
+    ring_push(&worker->submit, work);
+    sem_post(&worker->pending);
+}
+
+bool blk_workers_has_completions(void)
+{
+    for (int i = 0; i < num_workers; i++) {
+        work_ring_t *done = &workers[i].done;
+        if (done->head != __atomic_load_n(&done->tail, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int blk_workers_reap(blk_work_fn complete)
+{
+    /* Clear the eventfd before looking at the rings so that anything completed
+     * after we have looked signals it again */
+    uint64_t count;
+    if (read(done_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        LOG_BLK_WORKERS_ERR("Failed to read completion eventfd: %s\n", strerror(errno));
+    }
+
+    int reaped = 0;
+    blk_work_t work;
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *worker = &workers[i];
+        while (ring_pop(&worker->done, &work)) {
+            worker->outstanding--;
+            complete(&work);
+            reaped++;
+        }
+    }
+
+    return reaped;
+}
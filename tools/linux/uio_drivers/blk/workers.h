@@ -0,0 +1,53 @@
+/*
+ * Copyright 2024, UNSW
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sddf/blk/queue.h>
+
+/*
+ * Worker pool engine for the UIO block driver. Requests are handed from the
+ * event thread to a pool of I/O threads through lock-free single-producer,
+ * single-consumer rings, and the results come back the same way so that only
+ * the event thread ever touches the sDDF queues. Ordering between requests is
+ * up to the caller: requests handed over together may complete in any order.
+ */
+
+#define BLK_WORKERS_MAX 16
+
+typedef struct blk_work {
+    uint32_t code;
+    uintptr_t offset;
+    uint32_t block_number;
+    uint16_t count;
+    uint32_t id;
+    /* Filled in when the request is served */
+    blk_response_status_t status;
+    uint16_t success_count;
+} blk_work_t;
+
+/* Serves a request on a worker, or is handed a completed request on the event thread */
+typedef void (*blk_work_fn)(blk_work_t *work);
+
+/*
+ * Start num worker threads that call serve for every request handed to them.
+ * Returns an eventfd that becomes readable when requests complete, or -1 on failure.
+ */
+int blk_workers_init(int num, blk_work_fn serve);
+
+/* Returns true if another request can be handed to the workers */
+bool blk_workers_has_space(void);
+
+/* Hand a request to the least busy worker, there must be space */
+void blk_workers_submit(const blk_work_t *work);
+
+/* Returns true if there are completed requests to reap */
+bool blk_workers_has_completions(void);
+
+/* Calls complete for every completed request, returns how many there were */
+int blk_workers_reap(blk_work_fn complete);
@@ -15,6 +15,8 @@ else
 endif
 
 AARCH64_FILES := src/arch/aarch64/fault.c \
+		 src/arch/aarch64/decode.c \
+		 src/arch/aarch64/fault_stats.c \
 		 src/arch/aarch64/linux.c \
 		 src/arch/aarch64/linux.c \
 		 src/arch/aarch64/psci.c \
@@ -32,7 +34,8 @@ endif
 
 CFLAGS += -I${SDDF}/include
 
-ARCH_INDEP_FILES := src/util/printf.c \
+ARCH_INDEP_FILES := src/util/buddy.c \
+		    src/util/printf.c \
 		    src/util/util.c \
 		    src/virtio/block.c \
 		    src/virtio/console.c \